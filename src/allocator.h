@@ -9,6 +9,7 @@
 #include <map>
 #include <vector>
 
+#include "heap.h"
 #include "mem_pool.h"
 
 namespace UAllocator {
@@ -16,21 +17,57 @@ namespace Detail {
 
 static thread_local MemPool<>* cache = MemPool<>::create();
 
+/**
+ * @brief Allocator handle. By default it allocates from the thread local
+ * [cache]. When bound to a [Heap], every call goes to that heap instead.
+ */
 class AllocatorFrontEnd {
  public:
   AllocatorFrontEnd() = default;
+  explicit AllocatorFrontEnd(Heap& heap) noexcept : heap_(&heap) {}
   ~AllocatorFrontEnd() = default;
 
   inline void* allocate(size_t size) const noexcept {
+    if (heap_ != nullptr) {
+      return heap_->allocate(size);
+    }
     return cache->allocate(size);
   }
+  inline void* allocate_aligned(size_t size, size_t alignment) const noexcept {
+    if (heap_ != nullptr) {
+      return heap_->allocate_aligned(size, alignment);
+    }
+    return cache->allocate_aligned(size, alignment);
+  }
   inline void deallocate(void* ptr) const noexcept {
+    if (heap_ != nullptr) {
+      return heap_->deallocate(ptr);
+    }
     return cache->deallocate(ptr);
   }
+
+  // The heap this allocator is bound to, or nullptr for the thread cache.
+  inline Heap* heap() const noexcept { return heap_; }
+
+ private:
+  Heap* heap_ = nullptr;
 };
 }  // namespace Detail
 
 using Allocator = Detail::AllocatorFrontEnd;
 
+/**
+ * @brief Aligned allocation from the thread local pool, with the argument
+ * order of C11 [aligned_alloc]. Unlike libc memory, the result must be
+ * released by [pool_aligned_free] on the same thread, never by [free].
+ */
+inline void* pool_aligned_alloc(size_t alignment, size_t size) noexcept {
+  return Detail::cache->allocate_aligned(size, alignment);
+}
+
+inline void pool_aligned_free(void* ptr) noexcept {
+  Detail::cache->deallocate(ptr);
+}
+
 }  // namespace UAllocator
 #endif
\ No newline at end of file
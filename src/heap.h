@@ -0,0 +1,272 @@
+#ifndef UALLOCATOR_HEAP_H
+#define UALLOCATOR_HEAP_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <iterator>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+#include "mem_pool.h"
+
+namespace UAllocator {
+
+/**
+ * @brief An isolated allocation domain.
+ * A [Heap] owns a set of page runs and every chunk above [Threshold] which
+ * was allocated from it. Each run is a [FixedBlockSizeMemPool] serving one
+ * size class. When every run of a class is full, only that class grows by a
+ * new run, twice as large as its previous one up to [MaxRunPages] pages, so
+ * an empty heap costs nothing and a small one stays a few pages large.
+ * Destroying the heap releases every run and chunk at once, so objects
+ * allocated from it need not be freed one by one.
+ * A [Heap] is not thread safe. Use one heap per thread or lock around it.
+ */
+class Heap {
+ public:
+  using Pool = Detail::FixedBlockSizeMemPool<4096, 16>;
+
+  static constexpr size_t PageSize = 4096;
+  // Number of size classes. Block size of class i is 16 << i.
+  static constexpr size_t SizeNum = 7;
+  static constexpr size_t MinBlockSize = 16;
+  // Size threshold of blocks served by runs.
+  static constexpr size_t Threshold = MinBlockSize << (SizeNum - 1);
+  // Upper bound of pages in a run, which bounds the page scan in a run.
+  static constexpr size_t MaxRunPages = 16;
+
+  struct Stats {
+    // Number of allocate calls served by this heap.
+    size_t allocations_;
+    // Number of deallocate calls served by this heap.
+    size_t deallocations_;
+    // Number of page runs.
+    size_t runs_;
+    // Number of live chunks above [Threshold].
+    size_t large_chunks_;
+    // Bytes requested by live chunks above [Threshold].
+    size_t large_bytes_;
+    // Bytes held by run pages and large chunks.
+    size_t reserved_bytes_;
+  };
+
+  Heap() noexcept : large_list_(nullptr), stats_(), run_pages_() {}
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+  ~Heap() { release(); }
+
+  void *allocate(size_t size) noexcept {
+    ++stats_.allocations_;
+    if (size > Threshold) {
+      return allocate_large(size, Alignment);
+    }
+    return allocate_small(size);
+  }
+
+  /**
+   * @brief Allocate [size] bytes at an address which is a multiple of
+   * [alignment]. Blocks of class i are aligned to 16 << i, so small requests
+   * are served by the class of max([size], [alignment]).
+   * @param alignment A power of two. Otherwise nullptr is returned.
+   */
+  void *allocate_aligned(size_t size, size_t alignment) noexcept {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+      return nullptr;
+    }
+    ++stats_.allocations_;
+    if (size > Threshold || alignment > Threshold) {
+      return allocate_large(size,
+                            alignment > Alignment ? alignment : Alignment);
+    }
+    return allocate_small(size > alignment ? size : alignment);
+  }
+
+  /**
+   * @brief Give a pointer back to the heap.
+   * It's the caller's duty to guarantee the ptr is allocated from this heap.
+   */
+  void deallocate(void *ptr) noexcept {
+    if (ptr == nullptr) {
+      return;
+    }
+    ++stats_.deallocations_;
+    Run *run = find_run(ptr);
+    if (run != nullptr) {
+      run->pool_->deallocate_unsafe(ptr);
+      // The run has room again, so its class may allocate from it.
+      if (!run->has_room_) {
+        run->has_room_ = true;
+        partial_[run->class_id_].push_back(run);
+      }
+      return;
+    }
+    LargeHeader *header = reinterpret_cast<LargeHeader *>(ptr) - 1;
+    if (header->prev_ != nullptr) {
+      header->prev_->next_ = header->next_;
+    } else {
+      large_list_ = header->next_;
+    }
+    if (header->next_ != nullptr) {
+      header->next_->prev_ = header->prev_;
+    }
+    stats_.large_chunks_ -= 1;
+    stats_.large_bytes_ -= header->size_;
+    stats_.reserved_bytes_ -= header->reserved_;
+    free(header->base_);
+  }
+
+  // Whether [ptr] was allocated from a run of this heap.
+  inline bool owns(const void *ptr) const noexcept {
+    auto it = runs_.upper_bound(ptr);
+    return it != runs_.begin() &&
+           ptr < std::prev(it)->second.pool_->meta_.page_end_;
+  }
+
+  inline const Stats &stats() const noexcept { return stats_; }
+
+  /**
+   * @brief Free every run and chunk of this heap in one go. All pointers
+   * allocated from it become invalid. The heap stays usable.
+   */
+  void release() noexcept {
+    for (auto &run : runs_) {
+      free(run.second.pool_->meta_.page_base_);
+    }
+    runs_.clear();
+    for (size_t i = 0; i < SizeNum; ++i) {
+      partial_[i].clear();
+      run_pages_[i] = 0;
+    }
+    while (large_list_ != nullptr) {
+      LargeHeader *next = large_list_->next_;
+      free(large_list_->base_);
+      large_list_ = next;
+    }
+    stats_ = Stats();
+  }
+
+ private:
+  static constexpr size_t Alignment = 16;
+
+  /**
+   * @brief A run of pages serving one size class. The pool metadata lives
+   * in [meta_] so that the pages are exactly [PageSize] aligned pages. A run
+   * is listed in [partial_] of its class iff [has_room_] is set.
+   */
+  struct Run {
+    std::aligned_storage<sizeof(Pool), alignof(Pool)>::type meta_;
+    Pool *pool_;
+    size_t class_id_;
+    bool has_room_;
+  };
+
+  /**
+   * @brief Bookkeeping in front of every chunk above [Threshold].
+   * Chunks form a doubly linked list so that they can be freed with the
+   * heap.
+   */
+  struct LargeHeader {
+    LargeHeader *prev_;
+    LargeHeader *next_;
+    void *base_;
+    size_t size_;
+    size_t reserved_;
+  };
+
+  inline size_t get_class_id(size_t size) const noexcept {
+    size_t round_size = Detail::round2pow(size);
+    round_size = round_size > MinBlockSize ? round_size : MinBlockSize;
+    return Detail::ctz(round_size) - Detail::ctz(size_t(MinBlockSize));
+  }
+
+  void *allocate_small(size_t size) noexcept {
+    size_t id = get_class_id(size);
+    std::vector<Run *> &partial = partial_[id];
+    while (!partial.empty()) {
+      Run *run = partial.back();
+      void *ptr = run->pool_->allocate_from_pages();
+      if (ptr != nullptr) {
+        return ptr;
+      }
+      // Full runs leave the list until one of their blocks is freed.
+      run->has_room_ = false;
+      partial.pop_back();
+    }
+    Run *run = add_run(id);
+    if (run == nullptr) {
+      return nullptr;
+    }
+    return run->pool_->allocate_from_pages();
+  }
+
+  // Grow class [id] by a run twice as large as its previous one.
+  Run *add_run(size_t id) noexcept {
+    size_t page_num = run_pages_[id] == 0 ? 1 : run_pages_[id] * 2;
+    page_num = page_num < MaxRunPages ? page_num : MaxRunPages;
+    void *pages = Detail::aligned_span_malloc(page_num * PageSize, PageSize);
+    if (pages == nullptr) {
+      return nullptr;
+    }
+    run_pages_[id] = page_num;
+    Run &run = runs_[pages];
+    run.pool_ =
+        Pool::create(MinBlockSize << id, page_num, &run.meta_, pages);
+    run.class_id_ = id;
+    run.has_room_ = true;
+    partial_[id].push_back(&run);
+    stats_.runs_ += 1;
+    stats_.reserved_bytes_ += page_num * PageSize;
+    return &run;
+  }
+
+  void *allocate_large(size_t size, size_t alignment) noexcept {
+    // The header sits right before the returned pointer, and the offset keeps
+    // the returned pointer aligned.
+    size_t offset =
+        (sizeof(LargeHeader) + alignment - 1) / alignment * alignment;
+    char *base =
+        static_cast<char *>(Detail::aligned_malloc(offset + size, alignment));
+    if (base == nullptr) {
+      return nullptr;
+    }
+    LargeHeader *header = reinterpret_cast<LargeHeader *>(base + offset) - 1;
+    header->prev_ = nullptr;
+    header->next_ = large_list_;
+    header->base_ = base;
+    header->size_ = size;
+    header->reserved_ = offset + size;
+    if (large_list_ != nullptr) {
+      large_list_->prev_ = header;
+    }
+    large_list_ = header;
+    stats_.large_chunks_ += 1;
+    stats_.large_bytes_ += size;
+    stats_.reserved_bytes_ += header->reserved_;
+    return base + offset;
+  }
+
+  inline Run *find_run(const void *ptr) noexcept {
+    auto it = runs_.upper_bound(ptr);
+    if (it == runs_.begin()) {
+      return nullptr;
+    }
+    --it;
+    Pool *pool = it->second.pool_;
+    return ptr < pool->meta_.page_end_ ? &it->second : nullptr;
+  }
+
+  // Runs keyed by the address of their first page.
+  std::map<const void *, Run> runs_;
+  // Runs of each class which may have free blocks, most recent last.
+  std::vector<Run *> partial_[SizeNum];
+  LargeHeader *large_list_;
+  Stats stats_;
+  // Pages in the latest run of each class.
+  size_t run_pages_[SizeNum];
+};
+
+}  // namespace UAllocator
+
+#endif  // UALLOCATOR_HEAP_H
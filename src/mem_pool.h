@@ -2,9 +2,19 @@
 #define UALLOCATOR_MEM_POOL_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <algorithm>
+#include <type_traits>
+#include <utility>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define UALLOCATOR_X86_DISPATCH 1
+#endif
 
 namespace UAllocator {
 namespace Detail {
@@ -45,29 +55,125 @@ Int32 ctz(Int32 x) {
 
 // This helper function is modified from NCNN project
 // https://github.com/Tencent/ncnn/blob/00c08d7bda53b10dd488af3aa65de9c6dbe30cfb/src/allocator.h#L71-L90
-template<size_t BlockAlign>
-static void* aligned_malloc(size_t size)
+static inline void* aligned_malloc(size_t size, size_t align)
 {
 #if _MSC_VER
-    return _aligned_malloc(size, BlockAlign);
+    return _aligned_malloc(size, align);
 #elif (defined(__unix__) || defined(__APPLE__)) && _POSIX_C_SOURCE >= 200112L || (__ANDROID__ && __ANDROID_API__ >= 17)
     void* ptr = 0;
-    if (posix_memalign(&ptr, BlockAlign, size + 64))
+    if (posix_memalign(&ptr, align, size + 64))
         ptr = 0;
     return ptr;
 #elif __ANDROID__ && __ANDROID_API__ < 17
-    return memalign(BlockAlign, size + 64);
+    return memalign(align, size + 64);
 #else
-    unsigned char* udata = (unsigned char*)malloc(size + sizeof(void*) + BlockAlign + 64);
+    unsigned char* udata = (unsigned char*)malloc(size + sizeof(void*) + align + 64);
     if (!udata)
         return 0;
-    unsigned char** adata = alignPtr((unsigned char**)udata + 1, BlockAlign);
+    unsigned char** adata = alignPtr((unsigned char**)udata + 1, align);
     adata[-1] = udata;
     return adata;
 #endif
 }
 
-template <size_t PageSize, size_t BlockAlign>
+template<size_t BlockAlign>
+static void* aligned_malloc(size_t size)
+{
+    return aligned_malloc(size, BlockAlign);
+}
+
+/**
+ * @brief Like [aligned_malloc], but without the extra padding, so that a
+ * span of whole pages stays page-granular. [align] must be a power of two
+ * and a multiple of sizeof(void *).
+ */
+static inline void *aligned_span_malloc(size_t span, size_t align) {
+#if (defined(__unix__) || defined(__APPLE__)) && _POSIX_C_SOURCE >= 200112L
+  void *ptr = nullptr;
+  if (posix_memalign(&ptr, align, span)) {
+    ptr = nullptr;
+  }
+  return ptr;
+#else
+  return aligned_malloc(span, align);
+#endif
+}
+
+static inline size_t find_nonzero_word_scalar(const uint64_t *words,
+                                              size_t n) noexcept {
+  for (size_t i = 0; i < n; ++i) {
+    if (words[i] != 0) {
+      return i;
+    }
+  }
+  return n;
+}
+
+#ifdef UALLOCATOR_X86_DISPATCH
+__attribute__((target("sse2"))) static inline size_t find_nonzero_word_sse2(
+    const uint64_t *words, size_t n) noexcept {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+      return words[i] != 0 ? i : i + 1;
+    }
+  }
+  return i + find_nonzero_word_scalar(words + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline size_t find_nonzero_word_avx2(
+    const uint64_t *words, size_t n) noexcept {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + i));
+    if (!_mm256_testz_si256(v, v)) {
+      __m256i zero = _mm256_cmpeq_epi64(v, _mm256_setzero_si256());
+      unsigned mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(zero)) & 0xf;
+      return i + ctz(mask);
+    }
+  }
+  return i + find_nonzero_word_scalar(words + i, n - i);
+}
+#endif
+
+// Bitmaps shorter than this are scanned with plain compares. The runtime
+// dispatch costs more than a few scalar loads.
+static constexpr size_t SimdScanMinWords = 8;
+
+/**
+ * @brief Return the index of the first non-zero word in [words], or [n] if
+ * all of them are zero. On x86 the widest vector scan supported by the
+ * running CPU is picked once and reused.
+ */
+static inline size_t find_nonzero_word(const uint64_t *words,
+                                       size_t n) noexcept {
+#ifdef UALLOCATOR_X86_DISPATCH
+  static const int level = (__builtin_cpu_init(),
+                            __builtin_cpu_supports("avx2")   ? 2
+                            : __builtin_cpu_supports("sse2") ? 1
+                                                             : 0);
+  if (level == 2) {
+    return find_nonzero_word_avx2(words, n);
+  }
+  if (level == 1) {
+    return find_nonzero_word_sse2(words, n);
+  }
+#endif
+  return find_nonzero_word_scalar(words, n);
+}
+
+/**
+ * @brief How a page keeps track of its free blocks.
+ * [FreeList] threads an intrusive singly linked list through the free blocks.
+ * [Bitmap] keeps one bit per block in the page metadata, which makes
+ * emptiness checks, batch allocation and live-object iteration cheap.
+ */
+enum class PageMode { FreeList, Bitmap };
+
+template <size_t PageSize, size_t BlockAlign,
+          PageMode Mode = PageMode::FreeList>
 class FixedBlockSizeMemPool;
 
 /**
@@ -75,6 +181,9 @@ class FixedBlockSizeMemPool;
  * Blocks in the same page have the same size. A [MemPage] must
  * be [Size] aligned. A [MemPage] should not constructed directly
  * because we might want to make many continuous pages.
+ * Metadata lives at the tail of the page so that the data array starts
+ * at the page boundary. Block i is then at offset i * block_size, which
+ * makes blocks of power-of-two size naturally aligned.
  */
 template <size_t PageSize, size_t BlockAlign>
 class MemPage {
@@ -95,12 +204,12 @@ class MemPage {
   static constexpr size_t PaddingLen =
       (sizeof(Meta) + BlockAlign - 1) / BlockAlign * BlockAlign - sizeof(Meta);
 
-  Meta meta_;
+  // Data array holds the real block data.
+  char data_[PageSize - sizeof(Meta) - PaddingLen];
 
   char padding_[PaddingLen];
 
-  // Data array holds the real block data.
-  char data_[PageSize - sizeof(Meta) - sizeof(padding_)];
+  Meta meta_;
 
   MemPage() = delete;
   ~MemPage() = delete;
@@ -110,20 +219,23 @@ class MemPage {
    * @param block_size Size of a block in byte. It should be at least
    * sizeof(ListNode).
    * @param pool_base Pointer to the whole pool.
+   * @param offset Offset of the first block in [data_], used for cache
+   * coloring. Blocks must still fit in the page.
    */
-  inline void reset(
-      size_t block_size,
-      FixedBlockSizeMemPool<PageSize, BlockAlign> *pool_base) noexcept {
+  inline void reset(size_t block_size,
+                    FixedBlockSizeMemPool<PageSize, BlockAlign> *pool_base,
+                    size_t offset = 0) noexcept {
     block_size = (block_size + BlockAlign - 1) / BlockAlign * BlockAlign;
     meta_.pool_base_ = pool_base;
     size_t block_num =
-        (PageSize - sizeof(Meta) - sizeof(padding_)) / block_size;
+        (PageSize - sizeof(Meta) - sizeof(padding_) - offset) / block_size;
 
     // Appending all blocks to the free list.
-    meta_.plist_free_ = reinterpret_cast<ListNode *>(data_);
+    meta_.plist_free_ = reinterpret_cast<ListNode *>(&data_[offset]);
     ListNode *cur = meta_.plist_free_;
     for (size_t i = 1; i < block_num; ++i, cur = cur->next_) {
-      cur->next_ = reinterpret_cast<ListNode *>(&data_[i * block_size]);
+      cur->next_ =
+          reinterpret_cast<ListNode *>(&data_[offset + i * block_size]);
     }
     cur->next_ = nullptr;
   }
@@ -147,7 +259,7 @@ class MemPage {
   inline void deallocate_block(void *ptr) noexcept {
 #ifndef NDEBUG
     // Check if the ptr is from this page
-    if (ptr < this || ptr >= this + Size) {
+    if (ptr < this || ptr >= reinterpret_cast<char *>(this) + PageSize) {
       fprintf(stderr, "Error: deallocate an external pointer to this page!\n");
     }
 #endif
@@ -157,19 +269,218 @@ class MemPage {
   }
 };
 
+/**
+ * @brief Fix-sized page which tracks its blocks with a bitmap instead of an
+ * intrusive free list. A set bit means the block is free. Free blocks are
+ * never touched, so allocation only reads the metadata, and the page can
+ * tell which blocks are live without walking them.
+ * Layout constraints are the same as [MemPage].
+ */
+template <size_t PageSize, size_t BlockAlign>
+class BitmapMemPage {
+ public:
+  // Upper bound of blocks in a page, reached when block size is BlockAlign.
+  static constexpr size_t MaxBlockNum = PageSize / BlockAlign;
+  static constexpr size_t BitmapWords = (MaxBlockNum + 63) / 64;
+
+  /**
+   * @brief Metadata of this page. [hint_] is the lowest word of [free_] that
+   * may have a set bit; all words before it are zero. Block i starts at
+   * [offset_] + i * [block_size_] in [data_]. [block_inv_] turns the
+   * division by [block_size_] on deallocation into a multiply and shift.
+   */
+  struct Meta {
+    FixedBlockSizeMemPool<PageSize, BlockAlign, PageMode::Bitmap> *pool_base_;
+    uint32_t block_size_;
+    uint32_t block_inv_;
+    uint16_t block_num_;
+    uint16_t hint_;
+    uint16_t offset_;
+    uint64_t free_[BitmapWords];
+  };
+
+  static_assert(MaxBlockNum <= UINT16_MAX, "Too many blocks in a page.");
+  // Offsets and block sizes are below PageSize, which keeps the reciprocal
+  // division in [deallocate_block] exact.
+  static_assert(PageSize <= (size_t(1) << 16), "Page is too large.");
+
+  static constexpr size_t PaddingLen =
+      (sizeof(Meta) + BlockAlign - 1) / BlockAlign * BlockAlign - sizeof(Meta);
+
+  // Data array holds the real block data.
+  char data_[PageSize - sizeof(Meta) - PaddingLen];
+
+  char padding_[PaddingLen];
+
+  Meta meta_;
+
+  BitmapMemPage() = delete;
+  ~BitmapMemPage() = delete;
+
+  /**
+   * @brief Initialize all needed fields in this page.
+   * @param block_size Size of a block in byte.
+   * @param pool_base Pointer to the whole pool.
+   * @param offset Offset of the first block in [data_], used for cache
+   * coloring. Blocks must still fit in the page.
+   */
+  inline void reset(
+      size_t block_size,
+      FixedBlockSizeMemPool<PageSize, BlockAlign, PageMode::Bitmap> *pool_base,
+      size_t offset = 0) noexcept {
+    block_size = (block_size + BlockAlign - 1) / BlockAlign * BlockAlign;
+    meta_.pool_base_ = pool_base;
+    meta_.block_size_ = block_size;
+    meta_.block_inv_ = (uint64_t(1) << 32) / block_size + 1;
+    meta_.block_num_ = (sizeof(data_) - offset) / block_size;
+    meta_.offset_ = offset;
+    meta_.hint_ = 0;
+    for (size_t w = 0; w < BitmapWords; ++w) {
+      meta_.free_[w] = valid_mask(w);
+    }
+  }
+
+  /**
+   * @brief Allocate a block from this page.
+   * If there's no available data in page, a nullptr is returned.
+   */
+  inline void *allocate_block() noexcept {
+    size_t w = meta_.hint_;
+    // Only scan when the hinted word is drained. A full page keeps its hint
+    // at [BitmapWords] and is rejected without touching the bitmap.
+    if (w < BitmapWords && meta_.free_[w] == 0) {
+      w += scan(meta_.free_ + w, BitmapWords - w);
+      meta_.hint_ = w;
+    }
+    if (w == BitmapWords) {
+      return nullptr;
+    }
+    size_t bit = ctz(meta_.free_[w]);
+    meta_.free_[w] &= meta_.free_[w] - 1;
+    return &data_[meta_.offset_ + (w * 64 + bit) * meta_.block_size_];
+  }
+
+  /**
+   * @brief Allocate up to [n] blocks and store them in [out].
+   * Whole bitmap words are consumed at a time.
+   * @return Number of blocks actually allocated.
+   */
+  inline size_t allocate_batch(void **out, size_t n) noexcept {
+    size_t got = 0;
+    for (size_t w = meta_.hint_; w < BitmapWords && got < n; ++w) {
+      uint64_t bits = meta_.free_[w];
+      while (bits != 0 && got < n) {
+        out[got++] =
+            &data_[meta_.offset_ + (w * 64 + ctz(bits)) * meta_.block_size_];
+        bits &= bits - 1;
+      }
+      meta_.free_[w] = bits;
+      meta_.hint_ = w;
+    }
+    return got;
+  }
+
+  /**
+   * @brief Put the ptr back to page.
+   * It's the caller's duty to guarantee the ptr is allocated from this page.
+   */
+  inline void deallocate_block(void *ptr) noexcept {
+#ifndef NDEBUG
+    // Check if the ptr is from this page
+    if (ptr < this || ptr >= reinterpret_cast<char *>(this) + PageSize) {
+      fprintf(stderr, "Error: deallocate an external pointer to this page!\n");
+    }
+#endif
+    size_t id = (static_cast<char *>(ptr) - data_ - meta_.offset_) *
+                    uint64_t(meta_.block_inv_) >>
+                32;
+#ifndef NDEBUG
+    if (meta_.free_[id / 64] & (uint64_t(1) << (id % 64))) {
+      fprintf(stderr, "Error: double free of a block in this page!\n");
+    }
+#endif
+    meta_.free_[id / 64] |= uint64_t(1) << (id % 64);
+    meta_.hint_ = std::min<size_t>(meta_.hint_, id / 64);
+  }
+
+  inline size_t free_count() const noexcept {
+    size_t cnt = 0;
+    for (size_t w = 0; w < BitmapWords; ++w) {
+      cnt += __builtin_popcountll(meta_.free_[w]);
+    }
+    return cnt;
+  }
+
+  inline size_t live_count() const noexcept {
+    return meta_.block_num_ - free_count();
+  }
+
+  // Whether no block in this page is allocated.
+  inline bool empty() const noexcept {
+    for (size_t w = 0; w < BitmapWords; ++w) {
+      if (meta_.free_[w] != valid_mask(w)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether every block in this page is allocated.
+  inline bool full() const noexcept {
+    return scan(meta_.free_ + meta_.hint_, BitmapWords - meta_.hint_) ==
+           BitmapWords - meta_.hint_;
+  }
+
+  /**
+   * @brief Call [f] with the address of every allocated block, in address
+   * order.
+   */
+  template <typename F>
+  inline void for_each_live(F f) {
+    for (size_t w = 0; w < BitmapWords; ++w) {
+      uint64_t live = ~meta_.free_[w] & valid_mask(w);
+      while (live != 0) {
+        size_t id = w * 64 + ctz(live);
+        f(static_cast<void *>(&data_[meta_.offset_ + id * meta_.block_size_]));
+        live &= live - 1;
+      }
+    }
+  }
+
+ protected:
+  static inline size_t scan(const uint64_t *words, size_t n) noexcept {
+    return BitmapWords < SimdScanMinWords ? find_nonzero_word_scalar(words, n)
+                                          : find_nonzero_word(words, n);
+  }
+
+  // Bits of word [w] which map to a block that exists in this page.
+  inline uint64_t valid_mask(size_t w) const noexcept {
+    size_t lo = w * 64;
+    if (lo >= meta_.block_num_) {
+      return 0;
+    }
+    size_t cnt = meta_.block_num_ - lo;
+    return cnt >= 64 ? ~uint64_t(0) : (uint64_t(1) << cnt) - 1;
+  }
+};
+
 /**
  * @brief A memory pool contains several pages with the same page size.
  * All blocks in the same pool also have the same block size.
  * Due to alignment issues, do not construct [MemPool] directly.
  * Instead, use the [create] method.
  */
-template <size_t PageSize, size_t BlockAlign>
+template <size_t PageSize, size_t BlockAlign, PageMode Mode>
 class FixedBlockSizeMemPool {
  public:
-  using Page = MemPage<PageSize, BlockAlign>;
+  using Page = typename std::conditional<Mode == PageMode::Bitmap,
+                                         BitmapMemPage<PageSize, BlockAlign>,
+                                         MemPage<PageSize, BlockAlign>>::type;
 
   struct Meta {
     bool owned;
+    // Whether the first block of each page is shifted for cache coloring.
+    bool colored_;
     size_t block_size_;
     size_t page_num_;
     Page *page_base_;
@@ -192,10 +503,11 @@ class FixedBlockSizeMemPool {
    * should be provided with [page_base] at the same time.
    * @param page_base Similar as previous one, but points to the base address of
    * first page in pool.
+   * @param colored Whether to enable cache coloring, see [color_of].
    */
-  static inline FixedBlockSizeMemPool<PageSize, BlockAlign> *create(
+  static inline FixedBlockSizeMemPool<PageSize, BlockAlign, Mode> *create(
       size_t block_size, size_t page_num, void *pool_base = nullptr,
-      void *page_base = nullptr) noexcept {
+      void *page_base = nullptr, bool colored = false) noexcept {
     block_size = (block_size + BlockAlign - 1) / BlockAlign * BlockAlign;
     if (pool_base == nullptr && page_base == nullptr) {
       // Aligned new is C++17 feature. Now we have to manually translate
@@ -214,32 +526,118 @@ class FixedBlockSizeMemPool {
           page_base_ptr_val += PageSize;
         }
       }
-      FixedBlockSizeMemPool<PageSize, BlockAlign> *self =
-          reinterpret_cast<FixedBlockSizeMemPool<PageSize, BlockAlign> *>(
+      FixedBlockSizeMemPool<PageSize, BlockAlign, Mode> *self =
+          reinterpret_cast<
+              FixedBlockSizeMemPool<PageSize, BlockAlign, Mode> *>(
               self_ptr_val);
-      self->reset(block_size, page_base_ptr_val, page_num);
+      self->reset(block_size, page_base_ptr_val, page_num, colored);
       self->meta_.owned = true;
       return self;
     } else {
-      FixedBlockSizeMemPool<PageSize, BlockAlign> *self =
-          reinterpret_cast<FixedBlockSizeMemPool<PageSize, BlockAlign> *>(
-              pool_base);
-      self->reset(block_size, reinterpret_cast<size_t>(page_base), page_num);
+      FixedBlockSizeMemPool<PageSize, BlockAlign, Mode> *self =
+          reinterpret_cast<
+              FixedBlockSizeMemPool<PageSize, BlockAlign, Mode> *>(pool_base);
+      self->reset(block_size, reinterpret_cast<size_t>(page_base), page_num,
+                  colored);
       self->meta_.owned = false;
       return self;
     }
   }
 
   inline void *allocate() noexcept {
+    void *ptr = allocate_from_pages();
+    if (ptr != nullptr) {
+      return ptr;
+    }
+    // If all pages are full, malloc if by libc.
+    // return malloc(meta_.block_size_);
+    return aligned_malloc<BlockAlign>(meta_.block_size_);
+  }
+
+  /**
+   * @brief Allocate a block whose address is a multiple of [alignment].
+   * Blocks start at offset i * block_size in a page, so they are aligned to
+   * the lowest set bit of the block size. If that is not enough, or all pages
+   * are full, the block comes from libc.
+   * @param alignment A power of two.
+   */
+  inline void *allocate_aligned(size_t alignment) noexcept {
+    if (alignment <= BlockAlign) {
+      return allocate();
+    }
+    void *ptr = allocate_aligned_from_pages(alignment);
+    if (ptr != nullptr) {
+      return ptr;
+    }
+    return aligned_malloc(meta_.block_size_, alignment);
+  }
+
+  /**
+   * @brief Allocate a block from the pages only.
+   * If all pages are full, a nullptr is returned instead of going to libc.
+   */
+  inline void *allocate_from_pages() noexcept {
     for (size_t i = 0; i < meta_.page_num_; ++i) {
       void *ptr = meta_.page_base_[i].allocate_block();
       if (ptr != nullptr) {
         return ptr;
       }
     }
-    // If all pages are full, malloc if by libc.
-    // return malloc(meta_.block_size_);
-    return aligned_malloc<BlockAlign>(meta_.block_size_);
+    return nullptr;
+  }
+
+  /**
+   * @brief Aligned version of [allocate_from_pages]. A nullptr is also
+   * returned when blocks of this pool cannot satisfy [alignment].
+   */
+  inline void *allocate_aligned_from_pages(size_t alignment) noexcept {
+    if (alignment > BlockAlign && (meta_.block_size_ & (alignment - 1)) != 0) {
+      return nullptr;
+    }
+    // Colored pages only keep blocks aligned to the color unit.
+    if (meta_.colored_ && alignment > ColorUnit) {
+      return nullptr;
+    }
+    return allocate_from_pages();
+  }
+
+  /**
+   * @brief Allocate [n] blocks into [out]. Blocks are taken from the pages
+   * first, and the rest comes from libc.
+   * Only available in [PageMode::Bitmap].
+   */
+  inline void allocate_batch(void **out, size_t n) noexcept {
+    size_t got = 0;
+    for (size_t i = 0; i < meta_.page_num_ && got < n; ++i) {
+      got += meta_.page_base_[i].allocate_batch(out + got, n - got);
+    }
+    for (; got < n; ++got) {
+      out[got] = aligned_malloc<BlockAlign>(meta_.block_size_);
+    }
+  }
+
+  /**
+   * @brief Call [f] with every block allocated from the pages of this pool.
+   * Blocks which overflowed to libc are not visited.
+   * Only available in [PageMode::Bitmap].
+   */
+  template <typename F>
+  inline void for_each_live(F f) {
+    for (size_t i = 0; i < meta_.page_num_; ++i) {
+      meta_.page_base_[i].for_each_live(f);
+    }
+  }
+
+  /**
+   * @brief Number of pages without any allocated block.
+   * Only available in [PageMode::Bitmap].
+   */
+  inline size_t empty_page_num() const noexcept {
+    size_t cnt = 0;
+    for (size_t i = 0; i < meta_.page_num_; ++i) {
+      cnt += meta_.page_base_[i].empty();
+    }
+    return cnt;
   }
 
   /**
@@ -270,24 +668,50 @@ class FixedBlockSizeMemPool {
     page->deallocate_block(ptr);
   }
 
+  /**
+   * @brief Offset of the first block in [page] when cache coloring is on.
+   * Without coloring, block i of every page maps to the same cache sets.
+   * Colored pages rotate the first block by multiples of [ColorUnit], using
+   * the slack left when the page is not divisible by the block size.
+   */
+  inline size_t color_of(const Page *page) const noexcept {
+    if (!meta_.colored_) {
+      return 0;
+    }
+    size_t colors = sizeof(Page::data_) % meta_.block_size_ / ColorUnit + 1;
+    return reinterpret_cast<size_t>(page) / PageSize % colors * ColorUnit;
+  }
+
   FixedBlockSizeMemPool() = delete;
-  ~FixedBlockSizeMemPool() {
+  ~FixedBlockSizeMemPool() { destroy(); }
+
+  /**
+   * @brief Release the memory of a pool made by [create] without
+   * [pool_base]. Prefer this over calling the destructor by hand, which
+   * frees the object it runs on.
+   */
+  inline void destroy() noexcept {
     if (meta_.owned) {
       free(static_cast<void *>(this));
     }
   }
 
+  // Step between colors: a cache line, or BlockAlign if that is larger.
+  static constexpr size_t ColorUnit = BlockAlign > 64 ? BlockAlign : 64;
+
  protected:
-  inline void reset(size_t block_size, size_t page_base,
-                    size_t page_num) noexcept {
+  inline void reset(size_t block_size, size_t page_base, size_t page_num,
+                    bool colored) noexcept {
     block_size = (block_size + BlockAlign - 1) / BlockAlign * BlockAlign;
+    meta_.colored_ = colored;
     meta_.page_num_ = page_num;
     meta_.block_size_ = block_size;
     meta_.page_base_ = reinterpret_cast<Page *>(page_base);
     meta_.page_end_ =
         reinterpret_cast<Page *>(page_base + sizeof(Page) * page_num);
     for (size_t i = 0; i < page_num; ++i) {
-      meta_.page_base_[i].reset(block_size, this);
+      Page *page = &meta_.page_base_[i];
+      page->reset(block_size, this, color_of(page));
     }
   }
 };
@@ -300,7 +724,8 @@ class FixedBlockSizeMemPool {
  * comes from the MemPool cache or directly from libc malloc and send the
  * data back to MemPool cache or system memory correctly.
  */
-template <size_t PageSize = 4096, size_t BlockAlign = 16>
+template <size_t PageSize = 4096, size_t BlockAlign = 16,
+          PageMode Mode = PageMode::FreeList>
 class MemPool {
  public:
   // Number of different block sizes;
@@ -313,12 +738,13 @@ class MemPool {
   // Size threshold about whether the MemPool caches it.
   static constexpr size_t Threshold = SizeDist[SizeNum - 1].first;
 
-  using Page = MemPage<PageSize, BlockAlign>;
+  using Page =
+      typename FixedBlockSizeMemPool<PageSize, BlockAlign, Mode>::Page;
 
   struct Meta {
     void *pool_begin_;
     void *pool_end_;
-    FixedBlockSizeMemPool<PageSize, BlockAlign> *pool[SizeNum];
+    FixedBlockSizeMemPool<PageSize, BlockAlign, Mode> *pool[SizeNum];
   };
 
   static_assert(sizeof(Meta) <= PageSize, "Metadata must fit in a page.");
@@ -326,9 +752,16 @@ class MemPool {
   Meta meta_;
 
   MemPool() = delete;
-  ~MemPool() { free(static_cast<void *>(this)); }
+  ~MemPool() { destroy(); }
+
+  // Release the memory of a pool made by [create].
+  inline void destroy() noexcept { free(static_cast<void *>(this)); }
 
-  static MemPool *create() noexcept {
+  /**
+   * @param colored Whether to enable cache coloring in every page, see
+   * [FixedBlockSizeMemPool::color_of].
+   */
+  static MemPool *create(bool colored = false) noexcept {
     // Aligned new is C++17 feature. Now we have to manually translate
     // addresses.
     size_t need_page_num = 0;
@@ -349,11 +782,12 @@ class MemPool {
       }
     }
     MemPool *self = reinterpret_cast<MemPool *>(meta_ptr_val);
-    self->reset(pool_ptr_val, need_page_num);
+    self->reset(pool_ptr_val, need_page_num, colored);
     return self;
   }
 
-  void reset(size_t pool_ptr_val, size_t need_page_num) noexcept {
+  void reset(size_t pool_ptr_val, size_t need_page_num,
+             bool colored = false) noexcept {
     this->meta_.pool_begin_ = reinterpret_cast<void *>(pool_ptr_val);
     this->meta_.pool_end_ =
         reinterpret_cast<void *>(pool_ptr_val + need_page_num * PageSize);
@@ -363,8 +797,9 @@ class MemPool {
       size_t page_num = SizeDist[i].second;
       void *pool_base = reinterpret_cast<void *>(cur);
       void *page_base = reinterpret_cast<void *>(cur + PageSize);
-      this->meta_.pool[i] = FixedBlockSizeMemPool<PageSize, BlockAlign>::create(
-          block_size, page_num, pool_base, page_base);
+      this->meta_.pool[i] =
+          FixedBlockSizeMemPool<PageSize, BlockAlign, Mode>::create(
+              block_size, page_num, pool_base, page_base, colored);
     }
   }
 
@@ -382,6 +817,34 @@ class MemPool {
     return meta_.pool[id]->allocate();
   }
 
+  /**
+   * @brief Allocate [size] bytes at an address which is a multiple of
+   * [alignment]. Small requests are served by the pool whose block size is
+   * at least [alignment]. Larger ones come from libc, and page-aligned
+   * requests are rounded up to whole pages.
+   * @param alignment A power of two. Otherwise nullptr is returned.
+   */
+  void *allocate_aligned(size_t size, size_t alignment) noexcept {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+      return nullptr;
+    }
+    if (alignment <= BlockAlign) {
+      return allocate(size);
+    }
+    if (alignment >= PageSize) {
+      size_t span = (std::max(size, size_t(1)) + PageSize - 1) / PageSize *
+                    PageSize;
+      return aligned_span_malloc(span, alignment);
+    }
+    if (size > Threshold || alignment > Threshold) {
+      return aligned_malloc(size, alignment);
+    }
+    size_t round_size =
+        std::max(round2pow(std::max(size, alignment)), SizeDist[0].first);
+    size_t id = get_pool_id(round_size);
+    return meta_.pool[id]->allocate_aligned(alignment);
+  }
+
   void deallocate(void *ptr) noexcept {
     if (ptr < meta_.pool_begin_ || ptr >= meta_.pool_end_) {
       free(ptr);
@@ -394,13 +857,20 @@ class MemPool {
 };
 
 // In C++11, we have to redeclare them in namespace scope again.
+template <size_t PageSize, size_t BlockAlign, PageMode Mode>
+constexpr size_t MemPool<PageSize, BlockAlign, Mode>::SizeNum;
+template <size_t PageSize, size_t BlockAlign, PageMode Mode>
+constexpr std::pair<size_t, size_t>
+    MemPool<PageSize, BlockAlign,
+            Mode>::SizeDist[MemPool<PageSize, BlockAlign, Mode>::SizeNum];
+template <size_t PageSize, size_t BlockAlign, PageMode Mode>
+constexpr size_t MemPool<PageSize, BlockAlign, Mode>::Threshold;
+template <size_t PageSize, size_t BlockAlign, PageMode Mode>
+constexpr size_t FixedBlockSizeMemPool<PageSize, BlockAlign, Mode>::ColorUnit;
 template <size_t PageSize, size_t BlockAlign>
-constexpr size_t MemPool<PageSize, BlockAlign>::SizeNum;
-template <size_t PageSize, size_t BlockAlign>
-constexpr std::pair<size_t, size_t> MemPool<
-    PageSize, BlockAlign>::SizeDist[MemPool<PageSize, BlockAlign>::SizeNum];
+constexpr size_t BitmapMemPage<PageSize, BlockAlign>::MaxBlockNum;
 template <size_t PageSize, size_t BlockAlign>
-constexpr size_t MemPool<PageSize, BlockAlign>::Threshold;
+constexpr size_t BitmapMemPage<PageSize, BlockAlign>::BitmapWords;
 
 }  // namespace Detail
 }  // namespace UAllocator
@@ -0,0 +1,340 @@
+#ifndef UALLOCATOR_PERCPU_CACHE_H
+#define UALLOCATOR_PERCPU_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "shm_pool.h"
+
+// Per-CPU caches need restartable sequences, which glibc registers for every
+// thread since 2.35. The critical sections are written for x86-64 only.
+#if defined(__linux__) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/mman.h>
+#include <sys/rseq.h>
+#include <unistd.h>
+#define UALLOCATOR_RSEQ 1
+#endif
+#endif
+
+namespace UAllocator {
+namespace Detail {
+
+#ifdef UALLOCATOR_RSEQ
+
+/**
+ * @brief Process-wide cache with one small stack of free blocks per CPU and
+ * size class, in the spirit of tcmalloc. Push and pop are restartable
+ * sequences: the kernel aborts them if the thread is preempted or migrated
+ * before the final store, so they need neither locks nor atomics. Stacks
+ * are refilled from and flushed to a lock-free [SharedMemPool] backend in
+ * batches. Memory overhead grows with the number of CPUs, not threads.
+ * Use [get] to obtain the instance. It is nullptr when rseq is unavailable.
+ */
+class PerCpuCache {
+ public:
+  using Backend = SharedMemPool<>;
+
+  static constexpr size_t SizeNum = Backend::SizeNum;
+  static constexpr size_t Threshold = Backend::Threshold;
+  // Number of blocks a CPU caches per size class.
+  static constexpr size_t Capacity = 64;
+  // Number of blocks moved between a CPU and the backend at once.
+  static constexpr size_t BatchSize = 16;
+  // Address space reserved for the backend. Pages are committed on touch.
+  static constexpr size_t ReserveSize = size_t(1) << 30;
+
+  struct Slab {
+    intptr_t count_;
+    void *slots_[Capacity];
+  };
+
+  // Slabs of one CPU, cache line aligned to avoid false sharing.
+  struct alignas(64) CpuSlabs {
+    Slab slab_[SizeNum];
+  };
+
+  PerCpuCache(const PerCpuCache &) = delete;
+  PerCpuCache &operator=(const PerCpuCache &) = delete;
+
+  static PerCpuCache *get() noexcept {
+    static PerCpuCache instance;
+    return instance.backend_ != nullptr ? &instance : nullptr;
+  }
+
+  void *allocate(size_t size) noexcept {
+    if (size > Threshold) {
+      return aligned_malloc(size, 16);
+    }
+    size_t id = ctz(std::max(round2pow(size), Backend::MinBlockSize)) -
+                ctz(Backend::MinBlockSize);
+    void *ptr;
+    if (pop(id, &ptr)) {
+      return ptr;
+    }
+    return refill(id);
+  }
+
+  void deallocate(void *ptr) noexcept {
+    if (!backend_->contains(ptr)) {
+      free(ptr);
+      return;
+    }
+    size_t id = backend_->class_of(ptr);
+    if (!push(id, ptr)) {
+      flush(id, ptr);
+    }
+  }
+
+ protected:
+  PerCpuCache() noexcept : backend_(nullptr), slabs_(nullptr), cpu_num_(0) {
+    if (__rseq_size == 0 || int32_t(rseq_area()->cpu_id) < 0) {
+      return;
+    }
+    long cpu_num = possible_cpu_num();
+    void *base = mmap(nullptr, ReserveSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cpu_num <= 0 || base == MAP_FAILED) {
+      return;
+    }
+    slabs_ = static_cast<CpuSlabs *>(
+        aligned_malloc(sizeof(CpuSlabs) * cpu_num, alignof(CpuSlabs)));
+    if (slabs_ == nullptr) {
+      munmap(base, ReserveSize);
+      return;
+    }
+    memset(slabs_, 0, sizeof(CpuSlabs) * cpu_num);
+    cpu_num_ = cpu_num;
+    backend_ = Backend::create(base, ReserveSize);
+  }
+
+  /**
+   * @brief Number of CPU ids the kernel may report. Ids can be sparse or
+   * belong to hot-plugged CPUs, so this is the highest possible id plus one
+   * rather than the number of configured CPUs.
+   */
+  static long possible_cpu_num() noexcept {
+    long num = sysconf(_SC_NPROCESSORS_CONF);
+    FILE *fp = fopen("/sys/devices/system/cpu/possible", "r");
+    if (fp == nullptr) {
+      return num;
+    }
+    // The list looks like "0-7" or "0,2-5,8", so its last id is the highest.
+    char buf[256];
+    if (fgets(buf, sizeof(buf), fp) != nullptr) {
+      const char *last = buf;
+      for (const char *c = buf; *c != '\0'; ++c) {
+        if (*c == ',' || *c == '-') {
+          last = c + 1;
+        }
+      }
+      long id = strtol(last, nullptr, 10);
+      num = id + 1 > num ? id + 1 : num;
+    }
+    fclose(fp);
+    return num;
+  }
+
+  static inline struct rseq *rseq_area() noexcept {
+    char *tp;
+    __asm__("movq %%fs:0, %0" : "=r"(tp));
+    return reinterpret_cast<struct rseq *>(tp + __rseq_offset);
+  }
+
+  /**
+   * @brief Pop a block from the slab of class [id] on the current CPU.
+   * @return false if the slab is empty or the CPU has no slab.
+   */
+  inline bool pop(size_t id, void **out) noexcept {
+    struct rseq *rs = rseq_area();
+    for (;;) {
+      uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+      if (cpu >= cpu_num_) {
+        // No slab for this CPU. Callers go to the backend instead.
+        return false;
+      }
+      Slab *slab = &slabs_[cpu].slab_[id];
+      __asm__ __volatile__ goto(
+          ".pushsection __rseq_cs, \"aw\"\n\t"
+          ".balign 32\n\t"
+          "3:\n\t"
+          ".long 0x0, 0x0\n\t"
+          ".quad 1f, (2f - 1f), 4f\n\t"
+          ".popsection\n\t"
+          "leaq 3b(%%rip), %%rax\n\t"
+          "movq %%rax, %[rseq_cs]\n\t"
+          "1:\n\t"
+          "cmpl %[cpu], %[cpu_id]\n\t"
+          "jnz %l[aborted]\n\t"
+          "movq %[count], %%rbx\n\t"
+          "testq %%rbx, %%rbx\n\t"
+          "jz %l[empty]\n\t"
+          "subq $1, %%rbx\n\t"
+          "movq (%[slots], %%rbx, 8), %%rcx\n\t"
+          "movq %%rcx, (%[out])\n\t"
+          // Commit.
+          "movq %%rbx, %[count]\n\t"
+          "2:\n\t"
+          ".pushsection __rseq_failure, \"ax\"\n\t"
+          ".byte 0x0f, 0xb9, 0x3d\n\t"
+          ".long 0x53053053\n\t"
+          "4:\n\t"
+          "jmp %l[aborted]\n\t"
+          ".popsection\n\t"
+          :
+          : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id),
+            [rseq_cs] "m"(rs->rseq_cs), [count] "m"(slab->count_),
+            [slots] "r"(slab->slots_), [out] "r"(out)
+          : "memory", "cc", "rax", "rbx", "rcx"
+          : aborted, empty);
+      return true;
+    aborted:
+      continue;
+    empty:
+      return false;
+    }
+  }
+
+  /**
+   * @brief Push [ptr] onto the slab of class [id] on the current CPU.
+   * The slot is written before the commit, which is safe because nothing
+   * else can run on this CPU until the sequence ends or is aborted.
+   * @return false if the slab is full or the CPU has no slab.
+   */
+  inline bool push(size_t id, void *ptr) noexcept {
+    struct rseq *rs = rseq_area();
+    for (;;) {
+      uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+      if (cpu >= cpu_num_) {
+        // No slab for this CPU. Callers go to the backend instead.
+        return false;
+      }
+      Slab *slab = &slabs_[cpu].slab_[id];
+      __asm__ __volatile__ goto(
+          ".pushsection __rseq_cs, \"aw\"\n\t"
+          ".balign 32\n\t"
+          "3:\n\t"
+          ".long 0x0, 0x0\n\t"
+          ".quad 1f, (2f - 1f), 4f\n\t"
+          ".popsection\n\t"
+          "leaq 3b(%%rip), %%rax\n\t"
+          "movq %%rax, %[rseq_cs]\n\t"
+          "1:\n\t"
+          "cmpl %[cpu], %[cpu_id]\n\t"
+          "jnz %l[aborted]\n\t"
+          "movq %[count], %%rbx\n\t"
+          "cmpq %[cap], %%rbx\n\t"
+          "jae %l[full]\n\t"
+          "movq %[ptr], (%[slots], %%rbx, 8)\n\t"
+          "addq $1, %%rbx\n\t"
+          // Commit.
+          "movq %%rbx, %[count]\n\t"
+          "2:\n\t"
+          ".pushsection __rseq_failure, \"ax\"\n\t"
+          ".byte 0x0f, 0xb9, 0x3d\n\t"
+          ".long 0x53053053\n\t"
+          "4:\n\t"
+          "jmp %l[aborted]\n\t"
+          ".popsection\n\t"
+          :
+          : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id),
+            [rseq_cs] "m"(rs->rseq_cs), [count] "m"(slab->count_),
+            [slots] "r"(slab->slots_), [ptr] "r"(ptr),
+            [cap] "i"(Capacity)
+          : "memory", "cc", "rax", "rbx"
+          : aborted, full);
+      return true;
+    aborted:
+      continue;
+    full:
+      return false;
+    }
+  }
+
+  // Fetch a batch from the backend. One block is returned, the rest cached.
+  void *refill(size_t id) noexcept {
+    size_t block_size = Backend::MinBlockSize << id;
+    void *ret = backend_->allocate(block_size);
+    if (ret == nullptr) {
+      // The reserved range is exhausted.
+      return aligned_malloc(block_size, 16);
+    }
+    for (size_t i = 1; i < BatchSize; ++i) {
+      void *ptr = backend_->allocate(block_size);
+      if (ptr == nullptr) {
+        break;
+      }
+      if (!push(id, ptr)) {
+        backend_->deallocate(ptr);
+        break;
+      }
+    }
+    return ret;
+  }
+
+  // Return [ptr] and a batch of cached blocks to the backend.
+  void flush(size_t id, void *ptr) noexcept {
+    backend_->deallocate(ptr);
+    for (size_t i = 1; i < BatchSize; ++i) {
+      if (!pop(id, &ptr)) {
+        break;
+      }
+      backend_->deallocate(ptr);
+    }
+  }
+
+  Backend *backend_;
+  CpuSlabs *slabs_;
+  size_t cpu_num_;
+};
+
+#endif  // UALLOCATOR_RSEQ
+
+/**
+ * @brief Allocator handle backed by [PerCpuCache]. If rseq is not available
+ * at runtime or compile time, it falls back to the thread local [cache].
+ * In per-CPU mode blocks may be freed by any thread.
+ */
+class PerCpuAllocatorFrontEnd {
+ public:
+  PerCpuAllocatorFrontEnd() = default;
+  ~PerCpuAllocatorFrontEnd() = default;
+
+  inline void *allocate(size_t size) const noexcept {
+#ifdef UALLOCATOR_RSEQ
+    if (PerCpuCache *per_cpu = PerCpuCache::get()) {
+      return per_cpu->allocate(size);
+    }
+#endif
+    return cache->allocate(size);
+  }
+  inline void deallocate(void *ptr) const noexcept {
+#ifdef UALLOCATOR_RSEQ
+    if (PerCpuCache *per_cpu = PerCpuCache::get()) {
+      return per_cpu->deallocate(ptr);
+    }
+#endif
+    return cache->deallocate(ptr);
+  }
+
+  // Whether allocations go to per-CPU caches rather than the thread cache.
+  static inline bool per_cpu() noexcept {
+#ifdef UALLOCATOR_RSEQ
+    return PerCpuCache::get() != nullptr;
+#else
+    return false;
+#endif
+  }
+};
+
+}  // namespace Detail
+
+using PerCpuAllocator = Detail::PerCpuAllocatorFrontEnd;
+
+}  // namespace UAllocator
+
+#endif  // UALLOCATOR_PERCPU_CACHE_H
@@ -0,0 +1,320 @@
+#ifndef UALLOCATOR_SHM_POOL_H
+#define UALLOCATOR_SHM_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+#include "mem_pool.h"
+
+namespace UAllocator {
+
+/**
+ * @brief A memory pool living in a caller-provided region, typically a
+ * [memfd], [shm_open] object or regular file mapped with MAP_SHARED.
+ * Everything inside the region is addressed by its offset from the region
+ * base, so every process can map the region at a different address and
+ * still allocate and free in place. Free lists are lock-free tagged stacks,
+ * which makes allocation and deallocation safe across processes.
+ * The region base must be [PageSize] aligned and the region is limited to
+ * 4 GiB because offsets are stored in 32 bits.
+ * Do not construct [SharedMemPool] directly. Use [create] to format a region
+ * and [attach] to open a region formatted by another process.
+ */
+template <size_t PageSize = 4096, size_t BlockAlign = 16>
+class SharedMemPool {
+ public:
+  // Number of different block sizes. Block size of class i is 16 << i.
+  static constexpr size_t SizeNum = 7;
+  static constexpr size_t MinBlockSize = 16;
+  // Size threshold of blocks the pool can hand out.
+  static constexpr size_t Threshold = MinBlockSize << (SizeNum - 1);
+  static constexpr uint64_t Magic = 0x4c4f4f504d485355ULL;  // "USHMPOOL"
+
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+                "Cross-process free lists need lock-free 64-bit atomics.");
+  static_assert(BlockAlign >= sizeof(uint32_t),
+                "A free block must hold the offset of the next one.");
+
+  /**
+   * @brief Metadata at the tail of every page. Block size is recovered from
+   * [class_id_] on deallocation.
+   */
+  struct PageMeta {
+    uint32_t class_id_;
+  };
+
+  /**
+   * @brief Fix-sized page carved from the region. Layout is the same as
+   * [MemPage], but free blocks are linked by region offsets.
+   */
+  struct Page {
+    static constexpr size_t PaddingLen =
+        (sizeof(PageMeta) + BlockAlign - 1) / BlockAlign * BlockAlign -
+        sizeof(PageMeta);
+    char data_[PageSize - sizeof(PageMeta) - PaddingLen];
+    char padding_[PaddingLen];
+    PageMeta meta_;
+  };
+
+  static_assert(sizeof(Page) == PageSize, "Page must fill PageSize bytes.");
+
+  /**
+   * @brief Metadata at the region base. A free list head packs the offset of
+   * the first free block in its low 32 bits and an ABA tag in the high 32
+   * bits. Offset 0 is the metadata itself, so it marks an empty list.
+   */
+  struct Meta {
+    // Written last by [create], so a matching value publishes the header.
+    std::atomic<uint64_t> magic_;
+    uint64_t page_size_;
+    uint64_t block_align_;
+    uint64_t region_size_;
+    // Offset of the next page which has never been used.
+    std::atomic<uint64_t> bump_;
+    std::atomic<uint64_t> free_[SizeNum];
+  };
+
+  static_assert(sizeof(Meta) <= PageSize, "Metadata must fit in a page.");
+
+  Meta meta_;
+
+  SharedMemPool() = delete;
+  ~SharedMemPool() = delete;
+
+  /**
+   * @brief Format [size] bytes at [base] as an empty pool.
+   * @param base Region base address. It must be [PageSize] aligned.
+   * @param size Region size in byte. At most 4 GiB are used.
+   * @return nullptr if the region is misaligned or too small.
+   */
+  static SharedMemPool *create(void *base, size_t size) noexcept {
+    if ((reinterpret_cast<size_t>(base) & (PageSize - 1)) != 0 ||
+        size < 2 * PageSize) {
+      return nullptr;
+    }
+    size = std::min(size, size_t(UINT32_MAX) + 1) / PageSize * PageSize;
+    SharedMemPool *self = reinterpret_cast<SharedMemPool *>(base);
+    self->meta_.page_size_ = PageSize;
+    self->meta_.block_align_ = BlockAlign;
+    self->meta_.region_size_ = size;
+    self->meta_.bump_.store(PageSize, std::memory_order_relaxed);
+    for (size_t i = 0; i < SizeNum; ++i) {
+      self->meta_.free_[i].store(0, std::memory_order_relaxed);
+    }
+    // Publish the pool only after everything else is visible.
+    self->meta_.magic_.store(Magic, std::memory_order_release);
+    return self;
+  }
+
+  /**
+   * @brief Open a region formatted by [create], possibly in another process
+   * and at another address.
+   * @param size Number of bytes mapped at [base].
+   * @return nullptr if the region does not hold a pool with the same
+   * [PageSize] and [BlockAlign], or if fewer than its bytes are mapped.
+   */
+  static SharedMemPool *attach(void *base, size_t size) noexcept {
+    SharedMemPool *self = reinterpret_cast<SharedMemPool *>(base);
+    if ((reinterpret_cast<size_t>(base) & (PageSize - 1)) != 0 ||
+        size < PageSize ||
+        self->meta_.magic_.load(std::memory_order_acquire) != Magic ||
+        self->meta_.page_size_ != PageSize ||
+        self->meta_.block_align_ != BlockAlign ||
+        self->meta_.region_size_ > size) {
+      return nullptr;
+    }
+    return self;
+  }
+
+#if defined(__unix__) || defined(__APPLE__)
+  /**
+   * @brief Map [size] bytes of [fd] with MAP_SHARED and format or attach it.
+   * The file must already be at least [size] bytes long.
+   * @param format Whether to format the region as a new pool.
+   */
+  static SharedMemPool *map(int fd, size_t size, bool format) noexcept {
+    void *base =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      return nullptr;
+    }
+    SharedMemPool *self = format ? create(base, size) : attach(base, size);
+    if (self == nullptr) {
+      munmap(base, size);
+    }
+    return self;
+  }
+
+  /**
+   * @brief Unmap a region mapped by [map]. The pool stays intact for other
+   * processes.
+   * @param size The size passed to [map]. It may differ from the region
+   * size, which [create] rounds down and caps at 4 GiB.
+   */
+  void unmap(size_t size) noexcept { munmap(this, size); }
+#endif
+
+  /**
+   * @brief Allocate a block of at least [size] bytes.
+   * @return nullptr if [size] is above [Threshold] or the region is
+   * exhausted.
+   */
+  void *allocate(size_t size) noexcept {
+    if (size > Threshold) {
+      return nullptr;
+    }
+    size_t id = get_class_id(size);
+    void *ptr = pop(id);
+    if (ptr != nullptr) {
+      return ptr;
+    }
+    return refill(id);
+  }
+
+  /**
+   * @brief Give a block back to the pool. Any process which maps the
+   * region may free any block of it.
+   * It's the caller's duty to guarantee the ptr is allocated from this pool.
+   */
+  void deallocate(void *ptr) noexcept {
+    if (ptr == nullptr) {
+      return;
+    }
+#ifndef NDEBUG
+    if (!contains(ptr)) {
+      fprintf(stderr, "Error: deallocate an external pointer to this pool!\n");
+      return;
+    }
+#endif
+    Page *page = reinterpret_cast<Page *>(reinterpret_cast<size_t>(ptr) &
+                                          ~(PageSize - 1));
+    uint32_t off = to_offset(ptr);
+    push(page->meta_.class_id_, off, off);
+  }
+
+  // Size class of a block allocated from this pool.
+  inline size_t class_of(const void *ptr) const noexcept {
+    const Page *page = reinterpret_cast<const Page *>(
+        reinterpret_cast<size_t>(ptr) & ~(PageSize - 1));
+    return page->meta_.class_id_;
+  }
+
+  // Whether [ptr] points into the pages of this pool.
+  inline bool contains(const void *ptr) const noexcept {
+    const char *base = reinterpret_cast<const char *>(this);
+    return ptr >= base + PageSize && ptr < base + meta_.region_size_;
+  }
+
+  /**
+   * @brief Translate a pointer into this mapping to a region offset, which
+   * other processes can turn back into a pointer with [from_offset].
+   */
+  inline uint32_t to_offset(const void *ptr) const noexcept {
+    return static_cast<const char *>(ptr) -
+           reinterpret_cast<const char *>(this);
+  }
+
+  inline void *from_offset(uint32_t off) noexcept {
+    return reinterpret_cast<char *>(this) + off;
+  }
+
+ protected:
+  inline size_t get_class_id(size_t size) const noexcept {
+    size_t round_size = std::max(Detail::round2pow(size), MinBlockSize);
+    return Detail::ctz(round_size) - Detail::ctz(MinBlockSize);
+  }
+
+  inline size_t block_size(size_t id) const noexcept {
+    size_t size = MinBlockSize << id;
+    return (size + BlockAlign - 1) / BlockAlign * BlockAlign;
+  }
+
+  // The first 4 bytes of a free block hold the offset of the next one.
+  inline uint32_t *next_of(uint32_t off) noexcept {
+    return reinterpret_cast<uint32_t *>(from_offset(off));
+  }
+
+  void *pop(size_t id) noexcept {
+    uint64_t head = meta_.free_[id].load(std::memory_order_acquire);
+    for (;;) {
+      uint32_t off = static_cast<uint32_t>(head);
+      if (off == 0) {
+        return nullptr;
+      }
+      // The block may be popped and reused concurrently. Then the tag has
+      // changed and the exchange below fails, so a stale value is harmless.
+      uint32_t next = __atomic_load_n(next_of(off), __ATOMIC_RELAXED);
+      uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+      if (meta_.free_[id].compare_exchange_weak(head, new_head,
+                                                std::memory_order_acquire,
+                                                std::memory_order_acquire)) {
+        return from_offset(off);
+      }
+    }
+  }
+
+  /**
+   * @brief Push a chain of free blocks from [first] to [last], which are
+   * already linked to each other, onto the free list of class [id].
+   */
+  void push(size_t id, uint32_t first, uint32_t last) noexcept {
+    uint64_t head = meta_.free_[id].load(std::memory_order_relaxed);
+    for (;;) {
+      __atomic_store_n(next_of(last), static_cast<uint32_t>(head),
+                       __ATOMIC_RELAXED);
+      uint64_t new_head = ((head >> 32) + 1) << 32 | first;
+      if (meta_.free_[id].compare_exchange_weak(head, new_head,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Carve a new page for class [id]. The first block is returned and
+   * the rest are pushed onto the free list in one exchange.
+   */
+  void *refill(size_t id) noexcept {
+    uint64_t page_off = meta_.bump_.fetch_add(PageSize);
+    if (page_off + PageSize > meta_.region_size_) {
+      meta_.bump_.fetch_sub(PageSize);
+      return nullptr;
+    }
+    Page *page = reinterpret_cast<Page *>(from_offset(page_off));
+    page->meta_.class_id_ = id;
+    size_t bs = block_size(id);
+    size_t block_num = sizeof(page->data_) / bs;
+    uint32_t first = page_off + bs;
+    uint32_t last = page_off + (block_num - 1) * bs;
+    for (uint32_t off = first; off < last; off += bs) {
+      *next_of(off) = off + bs;
+    }
+    if (block_num > 1) {
+      push(id, first, last);
+    }
+    return page->data_;
+  }
+};
+
+// In C++11, we have to redeclare them in namespace scope again.
+template <size_t PageSize, size_t BlockAlign>
+constexpr size_t SharedMemPool<PageSize, BlockAlign>::SizeNum;
+template <size_t PageSize, size_t BlockAlign>
+constexpr size_t SharedMemPool<PageSize, BlockAlign>::MinBlockSize;
+template <size_t PageSize, size_t BlockAlign>
+constexpr size_t SharedMemPool<PageSize, BlockAlign>::Threshold;
+template <size_t PageSize, size_t BlockAlign>
+constexpr uint64_t SharedMemPool<PageSize, BlockAlign>::Magic;
+
+}  // namespace UAllocator
+
+#endif  // UALLOCATOR_SHM_POOL_H
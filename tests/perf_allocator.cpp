@@ -4,11 +4,13 @@
 #include <chrono>
 #include <iostream>
 #include <mutex>
+#include <random>
 #include <thread>
 #include <type_traits>
 #include <vector>
 
 #include "../src/allocator.h"
+#include "../src/percpu_cache.h"
 
 struct NaiveAllocator {
   inline void *allocate(size_t size) { return malloc(size); }
@@ -16,11 +18,11 @@ struct NaiveAllocator {
 };
 
 template <typename Allocator>
-int64_t thrd_task(Allocator &allocator, int64_t repeat) {
+int64_t thrd_task(Allocator &allocator, int64_t repeat, int64_t size_mask) {
   int64_t prevent_opt = 0;
   for (int64_t i = 0; i < repeat; ++i) {
     // void *ptr = allocator.allocate(1 + (i & 0x3ff));
-    void *ptr = allocator.allocate(1 + (i & 0xffff));
+    void *ptr = allocator.allocate(1 + (i & size_mask));
     prevent_opt ^= (int64_t)ptr ^ *(char *)ptr;
     allocator.deallocate(ptr);
   }
@@ -28,7 +30,8 @@ int64_t thrd_task(Allocator &allocator, int64_t repeat) {
 }
 
 template <typename Allocator>
-int64_t perf_one(const char *name, int thrd_num, int64_t repeat) {
+int64_t perf_one(const char *name, int thrd_num, int64_t repeat,
+                 int64_t size_mask = 0xffff) {
   static_assert(
       std::is_same<void *, decltype(std::declval<Allocator>().allocate(
                                (size_t)(1)))>::value,
@@ -47,7 +50,8 @@ int64_t perf_one(const char *name, int thrd_num, int64_t repeat) {
   auto clk = std::chrono::high_resolution_clock();
   auto test_start_time = clk.now();
   for (int i = 0; i < thrd_num; ++i) {
-    thrds.emplace_back(thrd_task<Allocator>, std::ref(allocator), repeat);
+    thrds.emplace_back(thrd_task<Allocator>, std::ref(allocator), repeat,
+                       size_mask);
   }
   for (int i = 0; i < thrd_num; ++i) {
     thrds[i].join();
@@ -68,25 +72,251 @@ int perf_all(int thrd_num, int64_t repeat, int epoch = 10) {
             ((double)cnt) / epoch / repeat / 2);        \
   }
 
-  int64_t naive_cnt = 0, base_cnt = 0, ua_cnt = 0;
+  int64_t naive_cnt = 0, base_cnt = 0, ua_cnt = 0, pc_cnt = 0;
   for (int i = 0; i < epoch; ++i) {
     fprintf(stdout, "epoch: %d\n", i);
     naive_cnt += _perf_one(NaiveAllocator);
     ua_cnt += _perf_one(UAllocator::Allocator);
+    pc_cnt += _perf_one(UAllocator::PerCpuAllocator);
     fprintf(stdout, "\n");
   }
   fprintf(stdout, "Average:\n");
   _summary(NaiveAllocator, naive_cnt);
   _summary(UAllocator::Allocator, ua_cnt);
+  _summary(UAllocator::PerCpuAllocator, pc_cnt);
+  return 0;
+}
+
+// Resident set size of this process in KiB, or 0 if unknown.
+long resident_kb() {
+  long pages = 0, resident = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == nullptr) {
+    return 0;
+  }
+  if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(fp);
+  return resident * 4;
+}
+
+/**
+ * Run far more threads than cores with small blocks. Thread caches pin
+ * their pages per thread, while per-CPU caches only grow with core count.
+ */
+int perf_many_threads(int thrd_num, int64_t repeat) {
+  fprintf(stdout, "%d threads, per-CPU mode: %s\n", thrd_num,
+          UAllocator::PerCpuAllocator::per_cpu() ? "rseq" : "thread cache");
+  long rss = resident_kb();
+  perf_one<UAllocator::PerCpuAllocator>("UAllocator::PerCpuAllocator",
+                                        thrd_num, repeat, 0x3ff);
+  fprintf(stdout, "RSS growth: %ld KiB\n", resident_kb() - rss);
+  rss = resident_kb();
+  perf_one<UAllocator::Allocator>("UAllocator::Allocator", thrd_num, repeat,
+                                  0x3ff);
+  fprintf(stdout, "RSS growth: %ld KiB\n", resident_kb() - rss);
+  return 0;
+}
+
+template <UAllocator::Detail::PageMode Mode>
+int64_t perf_page_mode_one(const char *name, size_t block_size,
+                           int64_t repeat) {
+  using Pool = UAllocator::Detail::FixedBlockSizeMemPool<4096, 16, Mode>;
+  constexpr size_t page_num = 16;
+  Pool *pool = Pool::create(block_size, page_num);
+  size_t block_num =
+      sizeof(Pool::Page::data_) / pool->meta_.block_size_ * page_num;
+  std::vector<void *> blocks(block_num);
+  // Free in a scattered order so that free lists get shuffled.
+  std::vector<size_t> order(block_num);
+  for (size_t i = 0; i < block_num; ++i) {
+    order[i] = i;
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(42));
+  int64_t prevent_opt = 0;
+  auto clk = std::chrono::high_resolution_clock();
+  auto start_time = clk.now();
+  for (int64_t rd = 0; rd < repeat; ++rd) {
+    for (size_t i = 0; i < block_num; ++i) {
+      blocks[i] = pool->allocate();
+    }
+    prevent_opt ^= (int64_t)blocks[rd % block_num];
+    for (size_t i = 0; i < block_num; ++i) {
+      pool->deallocate(blocks[order[i]]);
+    }
+  }
+  auto duration = (clk.now() - start_time).count();
+  fprintf(stdout, "%s block %lu: %0.6lf ns/op (%ld)\n", name, block_size,
+          double(duration) / repeat / block_num / 2, prevent_opt & 1);
+  pool->destroy();
+  return duration;
+}
+
+int perf_page_mode(int64_t repeat) {
+  using UAllocator::Detail::PageMode;
+  size_t block_size[] = {16, 64, 256};
+  for (size_t bs : block_size) {
+    perf_page_mode_one<PageMode::FreeList>("FreeList", bs, repeat);
+    perf_page_mode_one<PageMode::Bitmap>("Bitmap", bs, repeat);
+  }
+  return 0;
+}
+
+// Bitmap pages hand out a run of blocks in one call.
+template <typename Pool>
+void fill_pool(Pool *pool, std::vector<void *> &blocks, std::true_type) {
+  pool->allocate_batch(blocks.data(), blocks.size());
+}
+
+template <typename Pool>
+void fill_pool(Pool *pool, std::vector<void *> &blocks, std::false_type) {
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    blocks[i] = pool->allocate();
+  }
+}
+
+template <typename Pool>
+size_t count_empty_pages(Pool *pool, std::true_type) {
+  return pool->empty_page_num();
+}
+
+// Free-list pages must walk their free lists to tell whether they are empty.
+template <typename Pool>
+size_t count_empty_pages(Pool *pool, std::false_type) {
+  size_t block_num = sizeof(Pool::Page::data_) / pool->meta_.block_size_;
+  size_t cnt = 0;
+  for (size_t i = 0; i < pool->meta_.page_num_; ++i) {
+    size_t free_num = 0;
+    for (auto *node = pool->meta_.page_base_[i].meta_.plist_free_;
+         node != nullptr; node = node->next_) {
+      ++free_num;
+    }
+    cnt += free_num == block_num;
+  }
+  return cnt;
+}
+
+/**
+ * Time filling a whole pool at once, and counting empty pages after every
+ * other page has been drained. These are the operations bitmap pages are
+ * meant to speed up.
+ */
+template <UAllocator::Detail::PageMode Mode>
+int64_t perf_page_bulk_one(const char *name, size_t block_size,
+                           int64_t repeat) {
+  using Pool = UAllocator::Detail::FixedBlockSizeMemPool<4096, 16, Mode>;
+  using IsBitmap =
+      std::integral_constant<bool,
+                             Mode == UAllocator::Detail::PageMode::Bitmap>;
+  constexpr size_t page_num = 16;
+  Pool *pool = Pool::create(block_size, page_num);
+  size_t page_block_num = sizeof(Pool::Page::data_) / pool->meta_.block_size_;
+  std::vector<void *> blocks(page_block_num * page_num);
+  int64_t prevent_opt = 0;
+  auto clk = std::chrono::high_resolution_clock();
+  auto start_time = clk.now();
+  for (int64_t rd = 0; rd < repeat; ++rd) {
+    fill_pool(pool, blocks, IsBitmap());
+    prevent_opt ^= (int64_t)blocks[rd % blocks.size()];
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      pool->deallocate(blocks[i]);
+    }
+  }
+  auto fill_duration = (clk.now() - start_time).count();
+  fill_pool(pool, blocks, IsBitmap());
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    if (i / page_block_num % 2 == 0) {
+      pool->deallocate(blocks[i]);
+    }
+  }
+  start_time = clk.now();
+  for (int64_t rd = 0; rd < repeat; ++rd) {
+    prevent_opt += count_empty_pages(pool, IsBitmap());
+  }
+  auto empty_duration = (clk.now() - start_time).count();
+  fprintf(stdout,
+          "%s block %lu: fill %0.6lf ns/block, empty check %0.6lf ns/page "
+          "(%ld)\n",
+          name, block_size, double(fill_duration) / repeat / blocks.size(),
+          double(empty_duration) / repeat / page_num, prevent_opt & 1);
+  pool->destroy();
+  return fill_duration + empty_duration;
+}
+
+int perf_page_bulk(int64_t repeat) {
+  using UAllocator::Detail::PageMode;
+  size_t block_size[] = {16, 64, 256};
+  for (size_t bs : block_size) {
+    perf_page_bulk_one<PageMode::FreeList>("FreeList", bs, repeat);
+    perf_page_bulk_one<PageMode::Bitmap>("Bitmap", bs, repeat);
+  }
+  return 0;
+}
+
+struct ListNode {
+  ListNode *next_;
+  int64_t value_;
+};
+
+/**
+ * Build a linked list from the first block of every page and chase it.
+ * Without coloring those blocks share one page offset and compete for the
+ * same cache sets; with coloring they are spread over several sets.
+ */
+int64_t perf_coloring_one(bool colored, size_t block_size, size_t page_num,
+                          int64_t repeat) {
+  using Pool = UAllocator::Detail::FixedBlockSizeMemPool<4096, 16>;
+  Pool *pool = Pool::create(block_size, page_num, nullptr, nullptr, colored);
+  std::vector<ListNode *> heads(page_num, nullptr);
+  for (void *ptr; (ptr = pool->allocate_from_pages()) != nullptr;) {
+    size_t page_id =
+        ((size_t)ptr - (size_t)pool->meta_.page_base_) / sizeof(Pool::Page);
+    if (heads[page_id] == nullptr) {
+      heads[page_id] = (ListNode *)ptr;
+    }
+  }
+  // Visit pages in a shuffled order to defeat the prefetcher.
+  std::shuffle(heads.begin(), heads.end(), std::mt19937(42));
+  for (size_t i = 0; i < page_num; ++i) {
+    heads[i]->next_ = heads[(i + 1) % page_num];
+    heads[i]->value_ = i;
+  }
+  int64_t prevent_opt = 0;
+  ListNode *cur = heads[0];
+  auto clk = std::chrono::high_resolution_clock();
+  auto start_time = clk.now();
+  for (int64_t i = 0; i < repeat * int64_t(page_num); ++i) {
+    prevent_opt += cur->value_;
+    cur = cur->next_;
+  }
+  auto duration = (clk.now() - start_time).count();
+  fprintf(stdout, "%s block %lu, %lu pages: %0.6lf ns/node (%ld)\n",
+          colored ? "Colored" : "Uncolored", block_size, page_num,
+          double(duration) / repeat / page_num, prevent_opt & 1);
+  pool->destroy();
+  return duration;
+}
+
+int perf_coloring(int64_t repeat) {
+  size_t page_num[] = {32, 64, 128, 512};
+  for (size_t pn : page_num) {
+    perf_coloring_one(false, 512, pn, repeat);
+    perf_coloring_one(true, 512, pn, repeat);
+  }
   return 0;
 }
 
 int main() {
   return 0 ||
 #ifdef NDEBUG
-         perf_all(8, int64_t(3e7))
+         perf_all(8, int64_t(3e7)) || perf_page_mode(int64_t(1e4)) ||
+         perf_page_bulk(int64_t(1e4)) ||
+         perf_many_threads(1024, int64_t(1e5)) || perf_coloring(int64_t(1e5))
 #else
-         perf_all(8, int64_t(3e7))
+         perf_all(8, int64_t(3e7)) || perf_page_mode(int64_t(1e4)) ||
+         perf_page_bulk(int64_t(1e4)) ||
+         perf_many_threads(1024, int64_t(1e5)) || perf_coloring(int64_t(1e5))
 #endif
       ;
 }
\ No newline at end of file
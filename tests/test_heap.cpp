@@ -0,0 +1,137 @@
+#include <stdint.h>
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../src/allocator.h"
+#include "../src/heap.h"
+
+using UAllocator::Heap;
+
+int test_heap_alloc_free(size_t batch_num = size_t(50),
+                         size_t batch_size = size_t(1e4)) {
+  std::random_device rd{};
+  std::mt19937 gen{rd()};
+  std::uniform_int_distribution<> dist(1, 3000);
+  Heap heap;
+  for (size_t cur_b = 0; cur_b < batch_num; ++cur_b) {
+    std::vector<std::pair<char *, size_t>> allocated;
+    for (size_t id = 0; id < batch_size; ++id) {
+      size_t size = dist(gen);
+      char *ptr = (char *)heap.allocate(size);
+      if (ptr == nullptr || ((size_t)ptr & 15) != 0) {
+        fprintf(stderr, "Heap returned a bad pointer %p.\n", ptr);
+        return -1;
+      }
+      if (size <= Heap::Threshold && !heap.owns(ptr)) {
+        fprintf(stderr, "Small block of size %lu is not in a run.\n",
+                size);
+        return -1;
+      }
+      for (size_t b = 0; b < size; ++b) {
+        ptr[b] = 'a' + (b + size_t(ptr)) % 26;
+      }
+      allocated.push_back({ptr, size});
+    }
+    for (auto &block : allocated) {
+      for (size_t b = 0; b < block.second; ++b) {
+        if (block.first[b] != 'a' + (b + size_t(block.first)) % 26) {
+          fprintf(stderr, "Round %lu, byte %lu corrupted.\n", cur_b, b);
+          return -1;
+        }
+      }
+      heap.deallocate(block.first);
+    }
+    if (heap.stats().large_chunks_ != 0 || heap.stats().large_bytes_ != 0) {
+      fprintf(stderr, "Large chunks leaked after round %lu.\n", cur_b);
+      return -1;
+    }
+  }
+  if (heap.stats().allocations_ != heap.stats().deallocations_) {
+    fprintf(stderr, "Allocation and deallocation counts differ.\n");
+    return -1;
+  }
+  return 0;
+}
+
+int test_heap_release(size_t count = size_t(1e5)) {
+  Heap heap;
+  // Allocate far more than one run holds, and never free anything.
+  for (size_t i = 0; i < count; ++i) {
+    char *ptr = (char *)heap.allocate(1 + i % 2000);
+    ptr[0] = 'a';
+  }
+  void *aligned = heap.allocate_aligned(100, 4096);
+  if (((size_t)aligned & 4095) != 0) {
+    fprintf(stderr, "Heap returned a misaligned pointer.\n");
+    return -1;
+  }
+  if (heap.stats().runs_ < 2 || heap.stats().large_chunks_ == 0) {
+    fprintf(stderr, "Heap did not grow: %lu runs, %lu large chunks.\n",
+            heap.stats().runs_, heap.stats().large_chunks_);
+    return -1;
+  }
+  heap.release();
+  if (heap.stats().runs_ != 0 || heap.stats().reserved_bytes_ != 0) {
+    fprintf(stderr, "Heap still holds memory after release.\n");
+    return -1;
+  }
+  // The heap is usable again after release.
+  void *ptr = heap.allocate(64);
+  if (ptr == nullptr || !heap.owns(ptr)) {
+    fprintf(stderr, "Heap is not usable after release.\n");
+    return -1;
+  }
+  return 0;
+}
+
+int test_heap_growth(size_t count = 1200, size_t size = 1000) {
+  Heap heap;
+  heap.allocate(64);
+  // A fresh heap only grows the class it serves, by a single page.
+  if (heap.stats().runs_ != 1 || heap.stats().reserved_bytes_ != 4096) {
+    fprintf(stderr, "First allocation reserved %lu bytes in %lu runs.\n",
+            heap.stats().reserved_bytes_, heap.stats().runs_);
+    return -1;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    heap.allocate(size);
+  }
+  // Runs of a full class double up to MaxRunPages, so little is reserved
+  // beyond what the blocks need.
+  size_t need = count * 1024;
+  if (heap.stats().reserved_bytes_ > 2 * need) {
+    fprintf(stderr, "Heap reserved %lu bytes for %lu bytes of blocks.\n",
+            heap.stats().reserved_bytes_, need);
+    return -1;
+  }
+  return 0;
+}
+
+int test_heap_bound_allocator() {
+  Heap heap1, heap2;
+  UAllocator::Allocator a1(heap1), a2(heap2), thread_cache;
+  void *p1 = a1.allocate(32);
+  void *p2 = a2.allocate_aligned(32, 32);
+  void *p3 = thread_cache.allocate(32);
+  if (!heap1.owns(p1) || heap1.owns(p2) || !heap2.owns(p2) ||
+      heap1.owns(p3) || heap2.owns(p3) || a1.heap() != &heap1 ||
+      thread_cache.heap() != nullptr) {
+    fprintf(stderr, "Bound allocator does not use its heap.\n");
+    return -1;
+  }
+  a1.deallocate(p1);
+  a2.deallocate(p2);
+  thread_cache.deallocate(p3);
+  if (heap1.stats().deallocations_ != 1 || heap2.stats().deallocations_ != 1) {
+    fprintf(stderr, "Deallocation was not routed to the bound heap.\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main() {
+  return 0 || test_heap_alloc_free() || test_heap_release() ||
+         test_heap_growth() || test_heap_bound_allocator();
+}
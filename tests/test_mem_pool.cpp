@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 
 #include <iostream>
 #include <random>
@@ -8,12 +9,12 @@
 
 using namespace UAllocator::Detail;
 
+template <PageMode Mode>
 int test_fixed_size_pool_single_size(size_t block_size, size_t page_num,
                                      size_t batch_num = size_t(5e2),
                                      size_t batch_size = size_t(1e3)) {
-  using Page = FixedBlockSizeMemPool<4096, 64>::Page;
-  FixedBlockSizeMemPool<4096, 64> *pool =
-      FixedBlockSizeMemPool<4096, 64>::create(block_size, page_num);
+  FixedBlockSizeMemPool<4096, 64, Mode> *pool =
+      FixedBlockSizeMemPool<4096, 64, Mode>::create(block_size, page_num);
   int prevent_opt = ~0;
   for (size_t rd = 0; rd < batch_num; ++rd) {
     std::vector<void *> allocated;
@@ -66,7 +67,11 @@ int test_fixed_size_pool() {
   int result = 0;
   for (size_t bs = 0; bs < sizeof(block_size) / sizeof(size_t); ++bs) {
     for (size_t pn = 0; pn < sizeof(page_num) / sizeof(size_t); ++pn) {
-      result |= test_fixed_size_pool_single_size(block_size[bs], page_num[pn]);
+      result |= test_fixed_size_pool_single_size<PageMode::FreeList>(
+          block_size[bs], page_num[pn]);
+      // The duplicate check is quadratic, so Bitmap mode runs fewer rounds.
+      result |= test_fixed_size_pool_single_size<PageMode::Bitmap>(
+          block_size[bs], page_num[pn], size_t(5e1));
     }
   }
   return result;
@@ -107,4 +112,230 @@ int test_mem_pool(size_t batch_num = size_t(5e2),
   return prevent_opt;  // is always 0 if correct.
 }
 
-int main() { return 0 || test_fixed_size_pool() || test_mem_pool(); }
\ No newline at end of file
+int test_aligned_allocation(size_t batch_size = size_t(1e3)) {
+  size_t alignment[] = {8, 16, 32, 64, 128, 256, 512, 1024, 4096, 8192};
+  size_t size[] = {1, 24, 64, 100, 512, 1000, 3000, 5000};
+  auto pool = MemPool<>::create();
+  for (size_t a = 0; a < sizeof(alignment) / sizeof(size_t); ++a) {
+    for (size_t s = 0; s < sizeof(size) / sizeof(size_t); ++s) {
+      std::vector<char *> allocated;
+      for (size_t id = 0; id < batch_size; ++id) {
+        char *ptr = (char *)pool->allocate_aligned(size[s], alignment[a]);
+        if (ptr == nullptr) {
+          fprintf(stderr, "Aligned allocation failed.\n");
+          return -1;
+        }
+        if (((size_t)ptr & (alignment[a] - 1)) != 0) {
+          fprintf(stderr, "Size %lu, alignment %lu, got pointer %p.\n",
+                  size[s], alignment[a], ptr);
+          return -1;
+        }
+        // The first blocks of a small request must come from the pool.
+        bool from_pool = ptr >= pool->meta_.pool_begin_ &&
+                         ptr < pool->meta_.pool_end_;
+        if (id == 0 && size[s] <= 512 && alignment[a] <= 512 && !from_pool) {
+          fprintf(stderr, "Size %lu, alignment %lu, not served by pool.\n",
+                  size[s], alignment[a]);
+          return -1;
+        }
+        for (size_t b = 0; b < size[s]; ++b) {
+          ptr[b] = 'a' + (b + size_t(ptr)) % 26;
+        }
+        allocated.push_back(ptr);
+      }
+      for (char *ptr : allocated) {
+        for (size_t b = 0; b < size[s]; ++b) {
+          if (ptr[b] != 'a' + (b + size_t(ptr)) % 26) {
+            fprintf(stderr, "Size %lu, alignment %lu, byte %lu corrupted.\n",
+                    size[s], alignment[a], b);
+            return -1;
+          }
+        }
+        pool->deallocate(ptr);
+      }
+    }
+  }
+  if (pool->allocate_aligned(64, 48) != nullptr) {
+    fprintf(stderr, "Non power-of-two alignment should be rejected.\n");
+    return -1;
+  }
+  void *ptr = UAllocator::pool_aligned_alloc(64, 256);
+  if (ptr == nullptr || ((size_t)ptr & 63) != 0) {
+    fprintf(stderr, "pool_aligned_alloc returned a misaligned pointer.\n");
+    return -1;
+  }
+  UAllocator::pool_aligned_free(ptr);
+  return 0;
+}
+
+int test_find_nonzero_word(size_t max_words = 40) {
+  std::vector<uint64_t> words(max_words, 0);
+  for (size_t n = 0; n <= max_words; ++n) {
+    // All words zero, then a single non-zero word at every position, with
+    // a later non-zero word that must not be picked.
+    for (size_t pos = 0; pos <= n; ++pos) {
+      std::fill(words.begin(), words.end(), 0);
+      if (pos < n) {
+        words[pos] = uint64_t(1) << (pos % 64);
+        words[n - 1] |= 1;
+      }
+      size_t got[] = {find_nonzero_word(words.data(), n),
+                      find_nonzero_word_scalar(words.data(), n),
+#ifdef UALLOCATOR_X86_DISPATCH
+                      __builtin_cpu_supports("sse2")
+                          ? find_nonzero_word_sse2(words.data(), n)
+                          : pos,
+                      __builtin_cpu_supports("avx2")
+                          ? find_nonzero_word_avx2(words.data(), n)
+                          : pos,
+#endif
+      };
+      for (size_t i = 0; i < sizeof(got) / sizeof(size_t); ++i) {
+        if (got[i] != pos) {
+          fprintf(stderr, "Scan %lu of %lu words found %lu, expected %lu.\n",
+                  i, n, got[i], pos);
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+template <size_t PageSize>
+int test_bitmap_page() {
+  size_t block_size[] = {8, 16, 48, 64, 100, 512, 1024};
+  for (size_t bs = 0; bs < sizeof(block_size) / sizeof(size_t); ++bs) {
+    using Pool = FixedBlockSizeMemPool<PageSize, 16, PageMode::Bitmap>;
+    Pool *pool = Pool::create(block_size[bs], 2);
+    typename Pool::Page &page = pool->meta_.page_base_[0];
+    size_t block_num = page.meta_.block_num_;
+    if (!page.empty() || page.full() || pool->empty_page_num() != 2) {
+      fprintf(stderr, "Block size %lu, fresh page is not empty.\n",
+              block_size[bs]);
+      return -1;
+    }
+    std::vector<void *> blocks(block_num);
+    if (page.allocate_batch(blocks.data(), block_num) != block_num ||
+        !page.full() || page.allocate_block() != nullptr) {
+      fprintf(stderr, "Block size %lu, batch does not fill the page.\n",
+              block_size[bs]);
+      return -1;
+    }
+    // Free every other block and check that exactly the rest are live.
+    for (size_t i = 0; i < block_num; i += 2) {
+      page.deallocate_block(blocks[i]);
+    }
+    std::vector<void *> live;
+    pool->for_each_live([&](void *ptr) { live.push_back(ptr); });
+    if (live.size() != block_num / 2 || page.live_count() != block_num / 2) {
+      fprintf(stderr, "Block size %lu, expected %lu live blocks, got %lu.\n",
+              block_size[bs], block_num / 2, live.size());
+      return -1;
+    }
+    for (size_t i = 0; i < live.size(); ++i) {
+      if (live[i] != blocks[2 * i + 1]) {
+        fprintf(stderr, "Block size %lu, wrong live block %lu.\n",
+                block_size[bs], i);
+        return -1;
+      }
+    }
+    // Freed slots are handed out again, lowest address first.
+    if (page.allocate_block() != blocks[0]) {
+      fprintf(stderr, "Block size %lu, free slot search is wrong.\n",
+              block_size[bs]);
+      return -1;
+    }
+    page.deallocate_block(blocks[0]);
+    for (size_t i = 1; i < block_num; i += 2) {
+      page.deallocate_block(blocks[i]);
+    }
+    if (!page.empty() || page.free_count() != block_num) {
+      fprintf(stderr, "Block size %lu, page is not empty after free.\n",
+              block_size[bs]);
+      return -1;
+    }
+    pool->destroy();
+  }
+  return 0;
+}
+
+template <PageMode Mode>
+int test_cache_coloring_single_size(size_t block_size, size_t page_num = 64) {
+  using Pool = FixedBlockSizeMemPool<4096, 16, Mode>;
+  Pool *pool = Pool::create(block_size, page_num, nullptr, nullptr, true);
+  std::vector<char *> allocated;
+  std::vector<bool> first_offsets(4096, false);
+  size_t colors = 0;
+  for (char *ptr; (ptr = (char *)pool->allocate_from_pages()) != nullptr;) {
+    size_t offset = (size_t)ptr & 4095;
+    // Offset of the first block in the page.
+    size_t color = offset % pool->meta_.block_size_;
+    if (color % 64 != 0 || offset + block_size > 4096) {
+      fprintf(stderr, "Block size %lu, bad block offset %lu.\n", block_size,
+              offset);
+      return -1;
+    }
+    if (!first_offsets[color]) {
+      first_offsets[color] = true;
+      colors += 1;
+    }
+    memset(ptr, int(allocated.size()), block_size);
+    allocated.push_back(ptr);
+  }
+  size_t slack = sizeof(Pool::Page::data_) % pool->meta_.block_size_;
+  if (colors != std::min(slack / 64 + 1, page_num)) {
+    fprintf(stderr, "Block size %lu, expected %lu colors but got %lu.\n",
+            block_size, std::min(slack / 64 + 1, page_num), colors);
+    return -1;
+  }
+  for (size_t i = 0; i < allocated.size(); ++i) {
+    for (size_t b = 0; b < block_size; ++b) {
+      if (allocated[i][b] != char(i)) {
+        fprintf(stderr, "Block size %lu, block %lu corrupted.\n", block_size,
+                i);
+        return -1;
+      }
+    }
+    pool->deallocate(allocated[i]);
+  }
+  // Every block went back to its page.
+  for (size_t i = 0; i < allocated.size(); ++i) {
+    if (pool->allocate_from_pages() == nullptr) {
+      fprintf(stderr, "Block size %lu, lost blocks after free.\n",
+              block_size);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int test_cache_coloring() {
+  size_t block_size[] = {64, 128, 200, 512, 1024};
+  int result = 0;
+  for (size_t bs = 0; bs < sizeof(block_size) / sizeof(size_t); ++bs) {
+    result |= test_cache_coloring_single_size<PageMode::FreeList>(
+        block_size[bs]);
+    result |=
+        test_cache_coloring_single_size<PageMode::Bitmap>(block_size[bs]);
+  }
+  // Over-aligned requests still get correct addresses from colored pools.
+  auto pool = MemPool<>::create(true);
+  for (size_t alignment = 32; alignment <= 1024; alignment *= 2) {
+    void *ptr = pool->allocate_aligned(alignment, alignment);
+    if (((size_t)ptr & (alignment - 1)) != 0) {
+      fprintf(stderr, "Colored pool returned a misaligned pointer.\n");
+      return -1;
+    }
+    pool->deallocate(ptr);
+  }
+  return result;
+}
+
+int main() {
+  return 0 || test_fixed_size_pool() || test_mem_pool() ||
+         test_aligned_allocation() || test_find_nonzero_word() ||
+         // Large pages have long enough bitmaps to take the vector scan.
+         test_bitmap_page<4096>() || test_bitmap_page<65536>() ||
+         test_cache_coloring();
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include <future>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../src/percpu_cache.h"
+
+// Allocate and check blocks, then free them on another thread. The thread
+// cache fallback only allows same-thread frees, so there a thread hands the
+// blocks to itself.
+int thrd_task_per_cpu(int tid, int repeat, std::vector<std::mutex> &mutexes,
+                      std::vector<std::vector<char *>> &handoff) {
+  auto allocator = UAllocator::PerCpuAllocator();
+  std::mt19937 gen(tid);
+  std::uniform_int_distribution<> dis(1, 2048);
+  size_t next = UAllocator::PerCpuAllocator::per_cpu()
+                    ? (tid + 1) % handoff.size()
+                    : tid;
+  for (int i = 0; i < repeat; ++i) {
+    std::vector<char *> allocated;
+    for (int j = 0; j < 256; ++j) {
+      size_t len = dis(gen);
+      char *ptr = (char *)allocator.allocate(len);
+      memset(ptr, char(tid + len), len);
+      allocated.push_back(ptr);
+      allocated.push_back((char *)len);
+    }
+    for (size_t j = 0; j < allocated.size(); j += 2) {
+      size_t len = (size_t)allocated[j + 1];
+      for (size_t b = 0; b < len; ++b) {
+        if (allocated[j][b] != char(tid + len)) {
+          fprintf(stderr, "Thread %d, block of %lu bytes corrupted.\n", tid,
+                  len);
+          return -1;
+        }
+      }
+    }
+    // Hand the blocks to the next thread and free what we were handed.
+    std::vector<char *> received;
+    mutexes[next].lock();
+    for (size_t j = 0; j < allocated.size(); j += 2) {
+      handoff[next].push_back(allocated[j]);
+    }
+    mutexes[next].unlock();
+    mutexes[tid].lock();
+    received.swap(handoff[tid]);
+    mutexes[tid].unlock();
+    for (char *ptr : received) {
+      allocator.deallocate(ptr);
+    }
+  }
+  return 0;
+}
+
+int test_per_cpu_allocator(int thrd_num = 64, int repeat = 50) {
+  fprintf(stdout, "Per-CPU mode: %s\n",
+          UAllocator::PerCpuAllocator::per_cpu() ? "rseq" : "thread cache");
+  std::vector<std::future<int>> thrds(thrd_num);
+  std::vector<std::mutex> mutexes(thrd_num);
+  std::vector<std::vector<char *>> handoff(thrd_num);
+  for (int i = 0; i < thrd_num; ++i) {
+    thrds[i] = std::async(std::launch::async, thrd_task_per_cpu, i, repeat,
+                          std::ref(mutexes), std::ref(handoff));
+  }
+  int result = 0;
+  for (auto &thrd : thrds) {
+    result |= thrd.get();
+  }
+  auto allocator = UAllocator::PerCpuAllocator();
+  for (auto &blocks : handoff) {
+    for (char *ptr : blocks) {
+      allocator.deallocate(ptr);
+    }
+  }
+  return result;
+}
+
+int main() { return 0 || test_per_cpu_allocator(); }
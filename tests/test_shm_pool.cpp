@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+
+#include "../src/shm_pool.h"
+
+using Pool = UAllocator::SharedMemPool<>;
+
+constexpr size_t RegionSize = size_t(16) << 20;
+
+int open_region() {
+  int fd = memfd_create("uallocator_test", 0);
+  if (fd < 0 || ftruncate(fd, RegionSize) != 0) {
+    fprintf(stderr, "Failed to create a memfd region.\n");
+    return -1;
+  }
+  return fd;
+}
+
+int test_shm_pool_two_mappings() {
+  int fd = open_region();
+  if (fd < 0) {
+    return -1;
+  }
+  Pool *a = Pool::map(fd, RegionSize, true);
+  Pool *b = Pool::map(fd, RegionSize, false);
+  if (a == nullptr || b == nullptr || a == b) {
+    fprintf(stderr, "Failed to map the region twice.\n");
+    return -1;
+  }
+  // Allocate through one mapping, then read and free through the other.
+  std::vector<uint32_t> offsets;
+  for (size_t i = 0; i < 10000; ++i) {
+    size_t size = 1 + i % Pool::Threshold;
+    char *ptr = (char *)a->allocate(size);
+    if (ptr == nullptr || ((size_t)ptr & 15) != 0) {
+      fprintf(stderr, "Allocation of %lu bytes failed.\n", size);
+      return -1;
+    }
+    for (size_t j = 0; j < size; ++j) {
+      ptr[j] = 'a' + (i + j) % 26;
+    }
+    offsets.push_back(a->to_offset(ptr));
+  }
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    char *ptr = (char *)b->from_offset(offsets[i]);
+    size_t size = 1 + i % Pool::Threshold;
+    for (size_t j = 0; j < size; ++j) {
+      if (ptr[j] != 'a' + (i + j) % 26) {
+        fprintf(stderr, "Record %lu differs in the second mapping.\n", i);
+        return -1;
+      }
+    }
+    b->deallocate(ptr);
+  }
+  // Blocks freed through [b] are reused by [a].
+  uint32_t last = offsets.back();
+  size_t last_size = 1 + (offsets.size() - 1) % Pool::Threshold;
+  if (a->to_offset(a->allocate(last_size)) != last) {
+    fprintf(stderr, "Freed block is not reused.\n");
+    return -1;
+  }
+  if (a->allocate(Pool::Threshold + 1) != nullptr) {
+    fprintf(stderr, "Oversized request should fail.\n");
+    return -1;
+  }
+  a->deallocate(nullptr);
+  // A mapping shorter than the region must not attach.
+  if (Pool::map(fd, 2 * 4096, false) != nullptr) {
+    fprintf(stderr, "Short mapping should not attach.\n");
+    return -1;
+  }
+  a->unmap(RegionSize);
+  b->unmap(RegionSize);
+  close(fd);
+  return 0;
+}
+
+int test_shm_pool_cross_process(size_t rounds = 20, size_t batch = 2000) {
+  int fd = open_region();
+  if (fd < 0) {
+    return -1;
+  }
+  Pool *pool = Pool::map(fd, RegionSize, true);
+  // The producer writes record offsets here; 0 means not ready yet.
+  uint32_t *slots = (uint32_t *)pool->allocate(Pool::Threshold);
+  size_t slot_num = Pool::Threshold / sizeof(uint32_t);
+  for (size_t i = 0; i < slot_num; ++i) {
+    __atomic_store_n(&slots[i], 0, __ATOMIC_RELAXED);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Child: attach at a fresh address and produce records.
+    Pool *child = Pool::map(fd, RegionSize, false);
+    if (child == nullptr) {
+      _exit(1);
+    }
+    uint32_t *child_slots =
+        (uint32_t *)child->from_offset(pool->to_offset(slots));
+    for (size_t i = 0; i < rounds * batch; ++i) {
+      uint64_t *rec = (uint64_t *)child->allocate(64);
+      if (rec == nullptr) {
+        _exit(1);
+      }
+      for (size_t j = 0; j < 8; ++j) {
+        rec[j] = i * 8 + j;
+      }
+      uint32_t *slot = &child_slots[i % slot_num];
+      while (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != 0) {
+      }
+      __atomic_store_n(slot, child->to_offset(rec), __ATOMIC_RELEASE);
+    }
+    _exit(0);
+  }
+  // Parent: consume and free the records the child allocated.
+  for (size_t i = 0; i < rounds * batch; ++i) {
+    uint32_t *slot = &slots[i % slot_num];
+    uint32_t off;
+    while ((off = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) == 0) {
+    }
+    uint64_t *rec = (uint64_t *)pool->from_offset(off);
+    for (size_t j = 0; j < 8; ++j) {
+      if (rec[j] != i * 8 + j) {
+        fprintf(stderr, "Record %lu is corrupted.\n", i);
+        return -1;
+      }
+    }
+    pool->deallocate(rec);
+    __atomic_store_n(slot, 0, __ATOMIC_RELEASE);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Producer process failed.\n");
+    return -1;
+  }
+  // Records were recycled, so the region barely grew.
+  if (pool->meta_.bump_.load() > 64 * 4096) {
+    fprintf(stderr, "Freed records are not reused across processes.\n");
+    return -1;
+  }
+  pool->unmap(RegionSize);
+  close(fd);
+  return 0;
+}
+
+int main() {
+  return 0 || test_shm_pool_two_mappings() || test_shm_pool_cross_process();
+}